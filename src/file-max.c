@@ -29,15 +29,21 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "palette.h"
+#include "max-codec.h"
+#include "max-palette.h"
+#include "max-resource.h"
 
 #define MAX_PLUGIN_VERSION "0.1"
 
 #define LOAD_THUMB_PROC "file-max-load-thumb"
 #define LOAD_PROC "file-max-load"
+#define LOAD_RESOURCE_PROC "file-max-load-resource"
+#define PROBE_PROC "file-max-probe"
 #define SAVE_PROC "file-max-save"
 #define PLUG_IN_BINARY "file-max"
 #define PLUG_IN_ROLE "gimp-file-max"
+#define HOTSPOT_PARASITE "max-hotspot"
+#define AUTO_SAMPLE_ROWS 64
 
 #define MAX_SAVE_GUI                                                                                                 \
     "<?xml version=\"1.0\" encoding=\"UTF-8\"?><interface><requires lib=\"gtk+\" version=\"2.24\"/><!-- "            \
@@ -51,58 +57,77 @@
     "name=\"can_focus\">True</property><items><item translatable=\"yes\">Automatic Format</item><item "              \
     "translatable=\"yes\">MAX Simple</item><item translatable=\"yes\">MAX Big</item><item translatable=\"yes\">MAX " \
     "Multi</item><item translatable=\"yes\">MAX "                                                                    \
-    "Shadow</item></items></object></child></object></child></object></child></object></interface>"
-
-#define PALETTE_COLORS 256
-#define PALETTE_SIZE PALETTE_COLORS *(sizeof(guchar) + sizeof(guchar) + sizeof(guchar))
-#define RLE_BREAK_EVEN (2 * sizeof(gint16) + sizeof(guchar))
-
-struct MaxMultiImage {
-    gint32 file_offset;
-    gint16 width;
-    gint16 height;
-    gint16 hotx;
-    gint16 hoty;
-    gint32 *rows;
-    guchar *pixels;
-};
-
-enum MaxFormatTypes {
-    MAX_FORMAT_AUTO,
-    MAX_FORMAT_SIMPLE,
-    MAX_FORMAT_BIG,
-    MAX_FORMAT_MULTI,
-    MAX_FORMAT_SHADOW,
-};
+    "Shadow</item></items></object></child></object></child></object></child><child><object "                        \
+    "class=\"GimpFrame\" id=\"compression\"><property name=\"visible\">True</property><property "                    \
+    "name=\"label\" translatable=\"yes\">Big Image Compression</property><child><object "                            \
+    "class=\"GtkComboBoxText\" id=\"compression-combo\"><property name=\"visible\">True</property><property "        \
+    "name=\"can_focus\">True</property><items><item translatable=\"yes\">Fast</item><item "                          \
+    "translatable=\"yes\">Smallest Size</item><item translatable=\"yes\">Fast, Across Rows</item><item "             \
+    "translatable=\"yes\">Smallest Size, Across Rows</item></items></object></child></object></child><child>"        \
+    "<object class=\"GimpFrame\" id=\"palette\"><property name=\"visible\">True</property><property "                \
+    "name=\"label\" translatable=\"yes\">Big Image Palette of RGB Images</property><child><object "                  \
+    "class=\"GtkComboBoxText\" id=\"palette-combo\"><property name=\"visible\">True</property><property "            \
+    "name=\"can_focus\">True</property><items><item translatable=\"yes\">Game Palette</item><item "                  \
+    "translatable=\"yes\">Optimized</item><item translatable=\"yes\">Optimized, Keep Reserved "                      \
+    "Colors</item></items></object></child></object></child><child><object class=\"GimpFrame\" "                     \
+    "id=\"dither\"><property name=\"visible\">True</property><property name=\"label\" "                              \
+    "translatable=\"yes\">Dithering of RGB Images</property><child><object class=\"GtkComboBoxText\" "               \
+    "id=\"dither-combo\"><property name=\"visible\">True</property><property "                                       \
+    "name=\"can_focus\">True</property><items><item translatable=\"yes\">None</item><item "                          \
+    "translatable=\"yes\">Ordered</item><item "                                                                      \
+    "translatable=\"yes\">Floyd-Steinberg</item></items></object></child></object></child></object></interface>"
 
 struct MaxPluginSettings {
     gint file_type;
+    gint rle_mode;
     gint16 ulx;
     gint16 uly;
+    gint palette_mode;
+    gint dither_mode;
+};
+
+/** Row band of a drawable that is read on a worker thread during export. True color bands are mapped to palette
+ * indices by the reader, the indices of indexed drawables are the pixels themselves.
+ */
+struct MaxBand {
+    GeglBuffer *gbuffer;
+    const Babl *format;
+    struct MaxDither *dither;
+    gint width;
+    gint y;
+    gint rows;
+    guchar *pixels;
+    guchar *indices;
 };
 
 static void query(void);
 static void run(const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals, GimpParam **return_vals);
 static gint32 load_thumbnail(const gchar *filename, gint *width, gint *height, GError **error);
-static gboolean image_rle_decode(FILE *fd, gint data_size, guchar *pixels, gint width, gint height);
-static gboolean image_rle_encode_emit(FILE *fd, guchar *buffer, gint size, gboolean repeat_mode);
-static gboolean image_rle_encode(FILE *fd, guchar *buffer, gint rows, gint rowstride);
 static gint32 load_image(const gchar *filename, GError **error);
-static gint32 load_max_simple(FILE *fd, GError **error);
-static gint32 load_max_big(FILE *fd, gint file_size, GError **error);
-static gboolean decode_max_multi_image(FILE *fd, struct MaxMultiImage *image);
-static gboolean decode_max_multi_shadow(FILE *fd, struct MaxMultiImage *image);
-static gpointer read_max_multi_image(FILE *fd, guint32 address);
-static gint32 load_max_multi(FILE *fd, GError **error);
+static gint32 load_resource(const gchar *filename, const gchar *name, GError **error);
+static gint32 load_max_data(const guchar *data, gsize size, GError **error);
+static gint32 load_max_simple(const struct MaxHeader *header, GError **error);
+static gint32 load_max_big(const struct MaxHeader *header, GError **error);
+static gint32 load_max_multi(const guchar *data, gsize size, GError **error);
 static void on_dialog_response(GtkWidget *widget, gint response_id, gpointer data);
 static gboolean save_dialog(gint32 image_ID, GError **error);
 static GimpPDBStatusType save_image(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
                                     GError **error);
-// static gint32 save_max_simple(FILE *fd, GError **error);
-// static gint32 save_max_big(FILE *fd, GError **error);
-// static gint32 save_max_multi(FILE *fd, GError **error);
-
-static guchar max_default_palette[PALETTE_SIZE] = {PALETTE_INIT};
+static gboolean save_max_is_flat(gint32 image, gint32 drawable_ID);
+static gboolean save_max_write(const gchar *filename, struct MaxWriter *writer, GError **error);
+static const Babl *save_max_get_image(gint32 image, gint32 drawable_ID, struct MaxImage *max_image, GError **error);
+static void save_max_get_palette(gint32 drawable_ID, const Babl *format, guchar *palette);
+static gpointer save_max_read_band(gpointer data);
+static gboolean save_max_stream(const gchar *filename, gint32 drawable_ID, const struct MaxImage *max_image,
+                                const Babl *format, gint file_type, GError **error);
+static GimpPDBStatusType save_max_simple(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
+                                         GError **error);
+static GimpPDBStatusType save_max_big(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
+                                      GError **error);
+static struct MaxMulti *save_max_get_frames(gint32 image, GError **error);
+static GimpPDBStatusType save_max_multi(const gchar *filename, gint32 image, GimpRunMode run_mode, GError **error);
+static GimpPDBStatusType save_max_shadow(const gchar *filename, gint32 image, GimpRunMode run_mode, GError **error);
+static gint save_max_select_format(gint32 image, gint32 drawable_ID);
 
 static struct MaxPluginSettings max_settings = {MAX_FORMAT_AUTO};
 
@@ -123,6 +148,15 @@ static void query(void) {
                                                      {GIMP_PDB_INT32, "image-width", "Width of full-sized image"},
                                                      {GIMP_PDB_INT32, "image-height", "Height of full-sized image"}};
 
+    static const GimpParamDef probe_args[] = {{GIMP_PDB_STRING, "filename", "The name of the file to probe"}};
+
+    static const GimpParamDef probe_return_vals[] = {
+        {GIMP_PDB_INT32, "format", "The file format { SIMPLE (1), BIG (2), MULTI (3) } or -1 if not recognized"},
+        {GIMP_PDB_INT32, "image-width", "Width of the image or 0 for multi image files"},
+        {GIMP_PDB_INT32, "image-height", "Height of the image or 0 for multi image files"},
+        {GIMP_PDB_INT32, "image-count", "Number of images in multi image files"},
+    };
+
     static const GimpParamDef load_args[] = {
         {GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }"},
         {GIMP_PDB_STRING, "filename", "The name of the file to load"},
@@ -133,6 +167,12 @@ static void query(void) {
         {GIMP_PDB_IMAGE, "image", "Output image"},
     };
 
+    static const GimpParamDef load_resource_args[] = {
+        {GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }"},
+        {GIMP_PDB_STRING, "filename", "The name of the resource archive"},
+        {GIMP_PDB_STRING, "resource-name", "The name of the archive entry to load"},
+    };
+
     static const GimpParamDef save_args[] = {
         {GIMP_PDB_INT32, "run-mode", "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }"},
         {GIMP_PDB_IMAGE, "image", "Input image"},
@@ -148,6 +188,11 @@ static void query(void) {
 
     gimp_register_thumbnail_loader(LOAD_PROC, LOAD_THUMB_PROC);
 
+    gimp_install_procedure(PROBE_PROC, "Detects the format of a M.A.X. graphics file",
+                           "Reads only the header of the file. Plug-In version: " MAX_PLUGIN_VERSION,
+                           "M.A.X. Port Team", "M.A.X. Port Team", "2022", NULL, NULL, GIMP_PLUGIN,
+                           G_N_ELEMENTS(probe_args), G_N_ELEMENTS(probe_return_vals), probe_args, probe_return_vals);
+
     gimp_install_procedure(LOAD_PROC, "Loads M.A.X. graphics files", "Plug-In version: " MAX_PLUGIN_VERSION,
                            "M.A.X. Port Team", "M.A.X. Port Team", "2022", "MAX Image", NULL, GIMP_PLUGIN,
                            G_N_ELEMENTS(load_args), G_N_ELEMENTS(load_return_vals), load_args, load_return_vals);
@@ -156,8 +201,14 @@ static void query(void) {
 
     gimp_register_magic_load_handler(LOAD_PROC, "", "", "");
 
+    gimp_install_procedure(LOAD_RESOURCE_PROC, "Loads an image from a M.A.X. resource archive",
+                           "Reads the entry without extracting it. Plug-In version: " MAX_PLUGIN_VERSION,
+                           "M.A.X. Port Team", "M.A.X. Port Team", "2022", NULL, NULL, GIMP_PLUGIN,
+                           G_N_ELEMENTS(load_resource_args), G_N_ELEMENTS(load_return_vals), load_resource_args,
+                           load_return_vals);
+
     gimp_install_procedure(SAVE_PROC, "Saves M.A.X. graphics files", "Plug-In version: " MAX_PLUGIN_VERSION,
-                           "M.A.X. Port Team", "M.A.X. Port Team", "2022", "MAX Image", "INDEXED", GIMP_PLUGIN,
+                           "M.A.X. Port Team", "M.A.X. Port Team", "2022", "MAX Image", "INDEXED*, RGB*", GIMP_PLUGIN,
                            G_N_ELEMENTS(save_args), 0, save_args, NULL);
 
     gimp_register_file_handler_mime(SAVE_PROC, "image/max");
@@ -166,7 +217,7 @@ static void query(void) {
 }
 
 static void run(const gchar *name, gint nparams, const GimpParam *param, gint *nreturn_vals, GimpParam **return_vals) {
-    static GimpParam values[4];
+    static GimpParam values[5];
     GimpRunMode run_mode;
     GimpPDBStatusType status = GIMP_PDB_SUCCESS;
     GError *error = NULL;
@@ -205,6 +256,27 @@ static void run(const gchar *name, gint nparams, const GimpParam *param, gint *n
                 status = GIMP_PDB_EXECUTION_ERROR;
             }
         }
+    } else if (strcmp(name, PROBE_PROC) == 0) {
+        if (nparams < 1) {
+            status = GIMP_PDB_CALLING_ERROR;
+        } else {
+            struct MaxHeader header;
+
+            if (probe_max_file(param[0].data.d_string, &header, &error) == -1 && error) {
+                status = GIMP_PDB_EXECUTION_ERROR;
+            } else {
+                *nreturn_vals = 5;
+
+                values[1].type = GIMP_PDB_INT32;
+                values[1].data.d_int32 = header.format;
+                values[2].type = GIMP_PDB_INT32;
+                values[2].data.d_int32 = header.width;
+                values[3].type = GIMP_PDB_INT32;
+                values[3].data.d_int32 = header.height;
+                values[4].type = GIMP_PDB_INT32;
+                values[4].data.d_int32 = header.image_count;
+            }
+        }
     } else if (strcmp(name, LOAD_PROC) == 0) {
         switch (run_mode) {
             case GIMP_RUN_INTERACTIVE: {
@@ -218,6 +290,20 @@ static void run(const gchar *name, gint nparams, const GimpParam *param, gint *n
         if (status == GIMP_PDB_SUCCESS) {
             gint32 image_ID = load_image(param[1].data.d_string, &error);
 
+            if (image_ID != -1) {
+                *nreturn_vals = 2;
+                values[1].type = GIMP_PDB_IMAGE;
+                values[1].data.d_image = image_ID;
+            } else {
+                status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+    } else if (strcmp(name, LOAD_RESOURCE_PROC) == 0) {
+        if (nparams != 3 || !param[1].data.d_string || !param[2].data.d_string) {
+            status = GIMP_PDB_CALLING_ERROR;
+        } else {
+            gint32 image_ID = load_resource(param[1].data.d_string, param[2].data.d_string, &error);
+
             if (image_ID != -1) {
                 *nreturn_vals = 2;
                 values[1].type = GIMP_PDB_IMAGE;
@@ -232,7 +318,8 @@ static void run(const gchar *name, gint nparams, const GimpParam *param, gint *n
         GimpExportReturn export = GIMP_EXPORT_CANCEL;
 
         export = gimp_export_image(&image_ID, &drawable_ID, "M.A.X. Formats",
-                                   GIMP_EXPORT_CAN_HANDLE_ALPHA | GIMP_EXPORT_CAN_HANDLE_INDEXED);
+                                   GIMP_EXPORT_CAN_HANDLE_RGB | GIMP_EXPORT_CAN_HANDLE_ALPHA |
+                                       GIMP_EXPORT_CAN_HANDLE_INDEXED | GIMP_EXPORT_CAN_HANDLE_LAYERS);
 
         if (export == GIMP_EXPORT_CANCEL) {
             values[0].data.d_status = GIMP_PDB_CANCEL;
@@ -278,144 +365,53 @@ static void run(const gchar *name, gint nparams, const GimpParam *param, gint *n
     values[0].data.d_status = status;
 }
 
-gint32 load_thumbnail(const gchar *filename, gint *width, gint *height, GError **error) { return -1; }
-
-gboolean image_rle_decode(FILE *fd, gint data_size, guchar *pixels, gint width, gint height) {
-    gpointer buffer = NULL;
-    guchar *pointer = NULL;
-    gint16 option_word = 0;
-    gint image_size = width * height;
-
-    buffer = g_malloc(data_size);
-    if (!buffer) {
-        return FALSE;
-    }
-
-    if (data_size != fread(buffer, sizeof(guchar), data_size, fd)) {
-        g_free(buffer);
-        return FALSE;
-    }
-
-    pointer = buffer;
-
-    while (image_size > 0) {
-        option_word = GINT16_FROM_LE(*(gint16 *)pointer);
-        pointer += sizeof(option_word);
-
-        if (option_word > 0) {
-            memcpy(pixels, pointer, option_word);
-
-            pointer += option_word;
-        } else {
-            option_word = -option_word;
-
-            memset(pixels, pointer[0], option_word);
-
-            pointer += sizeof(guchar);
-        }
-
-        pixels += option_word;
-        image_size -= option_word;
-    }
-
-    g_free(buffer);
-    return TRUE;
-}
-
-gboolean image_rle_encode_emit(FILE *fd, guchar *buffer, gint size, gboolean repeat_mode) {
-    if (repeat_mode) {
-        gint16 option_word = -G_MAXINT16;
-
-        while (size) {
-            if (size >= G_MAXINT16) {
-                size -= G_MAXINT16;
-            } else {
-                option_word = -size;
-                size = 0;
-            }
-
-            if (1 != fwrite(&option_word, sizeof(option_word), 1, fd)) {
-                return FALSE;
-            }
-
-            if (1 != fwrite(buffer, sizeof(guchar), 1, fd)) {
-                return FALSE;
-            }
-        }
-    } else {
-        gint16 option_word = G_MAXINT16;
-        gint offset = 0;
-
-        while (size) {
-            if (size >= G_MAXINT16) {
-                size -= G_MAXINT16;
-            } else {
-                option_word = size;
-                size = 0;
-            }
-
-            if (1 != fwrite(&option_word, sizeof(option_word), 1, fd)) {
-                return FALSE;
-            }
-
-            if (option_word != fwrite(&buffer[offset], sizeof(guchar), option_word, fd)) {
-                return FALSE;
-            }
+gint32 load_thumbnail(const gchar *filename, gint *width, gint *height, GError **error) {
+    GMappedFile *mapped_file = NULL;
+    struct MaxImage *preview;
+    struct MaxHeader header;
+    gint32 image_ID = -1;
+    gint32 layer;
+    GeglBuffer *gbuffer;
+    gboolean result;
 
-            offset += option_word;
-        }
+    mapped_file = g_mapped_file_new(filename, FALSE, error);
+    if (!mapped_file) {
+        return image_ID;
     }
 
-    return TRUE;
-}
+    preview = decode_max_preview((const guchar *)g_mapped_file_get_contents(mapped_file),
+                                 g_mapped_file_get_length(mapped_file), MAX(*width, *height), &header, error);
 
-static inline gboolean image_rle_find_pattern(guchar *buffer) {
-    return buffer[0] == buffer[1] && buffer[1] == buffer[2] && buffer[2] == buffer[3] && buffer[3] == buffer[4];
-}
+    g_mapped_file_unref(mapped_file);
 
-gboolean image_rle_encode(FILE *fd, guchar *buffer, gint rows, gint rowstride) {
-    if (!fd) {
-        return FALSE;
+    if (!preview) {
+        return image_ID;
     }
 
-    for (int i = 0; i < rows; ++i) {
-        gboolean repeat_mode = FALSE;
-        gint start_position = i * rowstride;
-
-        for (gint j = i * rowstride; j < i * rowstride + rowstride; ++j) {
-            if (repeat_mode) {
-                if (buffer[j - 1] != buffer[j]) {
-                    if (!image_rle_encode_emit(fd, &buffer[start_position], j - start_position, repeat_mode)) {
-                        return FALSE;
-                    }
+    image_ID = gimp_image_new(preview->width, preview->height, GIMP_RGB);
+    g_assert(image_ID != -1);
 
-                    repeat_mode = FALSE;
-                    start_position = j;
-                }
+    layer = gimp_layer_new(image_ID, "Background", preview->width, preview->height, GIMP_RGB_IMAGE, 100,
+                           gimp_image_get_default_new_layer_mode(image_ID));
+    result = gimp_image_insert_layer(image_ID, layer, -1, 0);
+    g_assert(result);
 
-            } else if (rowstride > RLE_BREAK_EVEN && j > i * rowstride && image_rle_find_pattern(&buffer[j - 1])) {
-                if (!image_rle_encode_emit(fd, &buffer[start_position], j - start_position - 1, repeat_mode)) {
-                    return FALSE;
-                }
+    gbuffer = gimp_drawable_get_buffer(layer);
+    gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, 0, preview->width, preview->height), 0, NULL, preview->pixels,
+                    GEGL_AUTO_ROWSTRIDE);
+    g_object_unref(gbuffer);
 
-                repeat_mode = TRUE;
-                start_position = j - 1;
-            }
+    *width = header.width;
+    *height = header.height;
 
-            if (j == i * rowstride + rowstride - 1) {
-                if (!image_rle_encode_emit(fd, &buffer[start_position], i * rowstride + rowstride - start_position,
-                                           repeat_mode)) {
-                    return FALSE;
-                }
-            }
-        }
-    }
+    max_image_free(preview);
 
-    return TRUE;
+    return image_ID;
 }
 
 gint32 load_image(const gchar *filename, GError **error) {
-    FILE *fd = NULL;
+    GMappedFile *mapped_file = NULL;
+    const guchar *data = NULL;
     gsize file_size = 0;
     gint32 image_ID = -1;
     gboolean result;
@@ -424,114 +420,26 @@ gint32 load_image(const gchar *filename, GError **error) {
     result = gimp_progress_update(0.0);
     g_assert(result);
 
-    fd = g_fopen(filename, "rb");
-
-    if (!fd) {
-        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for reading: %s",
-                    gimp_filename_to_utf8(filename), g_strerror(errno));
-        return image_ID;
-    }
-
-    if (0 != fseek(fd, 0, SEEK_END)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-        fclose(fd);
-        return image_ID;
-    }
-
-    file_size = ftell(fd);
-    if (file_size == -1) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File tell error.");
-        fclose(fd);
-        return image_ID;
-    }
-
-    if (0 != fseek(fd, 0, SEEK_SET)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-        fclose(fd);
+    mapped_file = g_mapped_file_new(filename, FALSE, error);
+    if (!mapped_file) {
         return image_ID;
     }
 
-    {
-        gint16 width;
-        gint16 height;
-        gint16 hotx;
-        gint16 hoty;
-
-        if (1 == fread(&width, sizeof(width), 1, fd) && 1 == fread(&height, sizeof(height), 1, fd) &&
-            1 == fread(&hotx, sizeof(hotx), 1, fd) && 1 == fread(&hoty, sizeof(hoty), 1, fd)) {
-            width = GINT16_FROM_LE(width);
-            height = GINT16_FROM_LE(height);
-            hotx = GINT16_FROM_LE(hotx);
-            hoty = GINT16_FROM_LE(hoty);
-
-            if (width * height + sizeof(width) + sizeof(height) + sizeof(hotx) + sizeof(hoty) == file_size) {
-                image_ID = load_max_simple(fd, error);
-            }
-        }
-    }
-
-    if (image_ID == -1) {
-        gint16 hotx;
-        gint16 hoty;
-        gint16 width;
-        gint16 height;
-
-        if (0 != fseek(fd, 0, SEEK_SET)) {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-            fclose(fd);
-            return image_ID;
-        }
-
-        if (1 == fread(&hotx, sizeof(hotx), 1, fd) && 1 == fread(&hoty, sizeof(hoty), 1, fd) &&
-            1 == fread(&width, sizeof(width), 1, fd) && 1 == fread(&height, sizeof(height), 1, fd)) {
-            hotx = GINT16_FROM_LE(hotx);
-            hoty = GINT16_FROM_LE(hoty);
-            width = GINT16_FROM_LE(width);
-            height = GINT16_FROM_LE(height);
-
-            if (hotx == 0 && hoty == 0 && width > 0 && height > 0) {
-                image_ID = load_max_big(fd, file_size, error);
-            }
-        }
-    }
-
-    if (image_ID == -1) {
-        gint16 image_count;
-        guint32 firt_image_offset;
-
-        if (0 != fseek(fd, 0, SEEK_SET)) {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-            fclose(fd);
-            return image_ID;
-        }
+    data = (const guchar *)g_mapped_file_get_contents(mapped_file);
+    file_size = g_mapped_file_get_length(mapped_file);
 
-        if (1 == fread(&image_count, sizeof(image_count), 1, fd) &&
-            1 == fread(&firt_image_offset, sizeof(firt_image_offset), 1, fd)) {
-            image_count = GINT16_FROM_LE(image_count);
-            firt_image_offset = GUINT32_FROM_LE(firt_image_offset);
+    image_ID = load_max_data(data, file_size, error);
 
-            if (image_count > 0 && firt_image_offset < file_size) {
-                image_ID = load_max_multi(fd, error);
-            }
-        }
-    }
+    g_mapped_file_unref(mapped_file);
 
     if (image_ID == -1) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format not recognized.");
-        fclose(fd);
         return image_ID;
     }
 
     /** \todo Save format type for later export */
 
-    if (image_ID != -1) {
-        result = gimp_image_set_filename(image_ID, filename);
-        g_assert(result);
-    }
-
-    if (EOF == fclose(fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to close '%s'.", gimp_filename_to_utf8(filename));
-    }
+    result = gimp_image_set_filename(image_ID, filename);
+    g_assert(result);
 
     result = gimp_progress_update(100.0);
     g_assert(result);
@@ -539,424 +447,238 @@ gint32 load_image(const gchar *filename, GError **error) {
     return image_ID;
 }
 
-gint32 load_max_simple(FILE *fd, GError **error) {
-    gpointer pixels = NULL;
-    gint pixel_count = -1;
+/**
+ * Loads an entry of a resource archive. The image is named after the entry in the directory of the archive, so that
+ * an export writes an extracted file instead of touching the archive.
+ */
+gint32 load_resource(const gchar *filename, const gchar *name, GError **error) {
+    struct MaxResource *resource;
+    const guchar *data;
+    gsize size;
     gint32 image_ID = -1;
-    gint32 layer;
-    GeglBuffer *gbuffer;
-    gint16 width;
-    gint16 height;
-    gint16 hotx;
-    gint16 hoty;
     gboolean result;
 
-    if (0 != fseek(fd, 0, SEEK_SET)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
+    gimp_progress_init_printf("Opening '%s' from '%s'", name, gimp_filename_to_utf8(filename));
+    result = gimp_progress_update(0.0);
+    g_assert(result);
+
+    resource = max_resource_open(filename, error);
+    if (!resource) {
         return image_ID;
     }
 
-    if (1 != fread(&width, sizeof(width), 1, fd) || 1 != fread(&height, sizeof(height), 1, fd) ||
-        1 != fread(&hotx, sizeof(hotx), 1, fd) || 1 != fread(&hoty, sizeof(hoty), 1, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        return image_ID;
+    data = max_resource_get_data(resource, name, &size, error);
+
+    if (data) {
+        image_ID = load_max_data(data, size, error);
     }
 
-    width = GINT16_FROM_LE(width);
-    height = GINT16_FROM_LE(height);
-    hotx = GINT16_FROM_LE(hotx);
-    hoty = GINT16_FROM_LE(hoty);
+    max_resource_close(resource);
 
-    pixel_count = width * height;
-    g_assert(pixel_count > 0);
+    if (image_ID != -1) {
+        gchar *dirname = g_path_get_dirname(filename);
+        gchar *basename = g_strconcat(name, ".max", NULL);
+        gchar *image_filename = g_build_filename(dirname, basename, NULL);
 
-    pixels = g_malloc(pixel_count);
-    if (!pixels) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
-        return image_ID;
+        result = gimp_image_set_filename(image_ID, image_filename);
+        g_assert(result);
+
+        g_free(image_filename);
+        g_free(basename);
+        g_free(dirname);
+
+        result = gimp_progress_update(100.0);
+        g_assert(result);
     }
 
-    if (pixel_count != fread(pixels, sizeof(guchar), pixel_count, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        g_free(pixels);
-        return image_ID;
+    return image_ID;
+}
+
+/**
+ * Decodes an in-memory M.A.X. image of any format into a new image.
+ */
+gint32 load_max_data(const guchar *data, gsize size, GError **error) {
+    struct MaxHeader header;
+    gint32 image_ID = -1;
+
+    switch (sniff_max_format(data, size, size, &header)) {
+        case MAX_FORMAT_SIMPLE: {
+            image_ID = load_max_simple(&header, error);
+        } break;
+        case MAX_FORMAT_BIG: {
+            image_ID = load_max_big(&header, error);
+        } break;
+        case MAX_FORMAT_MULTI: {
+            image_ID = load_max_multi(data, size, error);
+        } break;
+        default: {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format not recognized.");
+        } break;
     }
 
-    image_ID = gimp_image_new(width, height, GIMP_INDEXED);
+    return image_ID;
+}
+
+gint32 load_max_simple(const struct MaxHeader *header, GError **error) {
+    gint32 image_ID = -1;
+    gint32 layer;
+    GeglBuffer *gbuffer;
+    gboolean result;
+
+    image_ID = gimp_image_new(header->width, header->height, GIMP_INDEXED);
     g_assert(image_ID != -1);
 
-    layer = gimp_layer_new(image_ID, "Background", width, height, GIMP_INDEXED_IMAGE, 100,
+    layer = gimp_layer_new(image_ID, "Background", header->width, header->height, GIMP_INDEXED_IMAGE, 100,
                            gimp_image_get_default_new_layer_mode(image_ID));
     result = gimp_image_insert_layer(image_ID, layer, -1, 0);
     g_assert(result);
 
     gbuffer = gimp_drawable_get_buffer(layer);
-    gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, 0, width, height), 0, NULL, pixels, GEGL_AUTO_ROWSTRIDE);
+    gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, 0, header->width, header->height), 0, NULL, header->payload,
+                    GEGL_AUTO_ROWSTRIDE);
     g_object_unref(gbuffer);
 
     result = gimp_image_set_colormap(image_ID, max_default_palette, PALETTE_COLORS);
     g_assert(result);
 
-    g_free(pixels);
-
     return image_ID;
 }
 
-gint32 load_max_big(FILE *fd, gint file_size, GError **error) {
-    gpointer pixels = NULL;
-    gpointer palette = NULL;
-    gint pixel_count = -1;
+gint32 load_max_big(const struct MaxHeader *header, GError **error) {
+    struct MaxRleDecoder decoder;
+    guchar *band = NULL;
+    gint band_rows;
     gint32 image_ID = -1;
     gint32 layer;
     GeglBuffer *gbuffer;
-    gint16 width;
-    gint16 height;
-    gint16 hotx;
-    gint16 hoty;
+    gboolean decoded = TRUE;
     gboolean result;
 
-    if (0 != fseek(fd, 0, SEEK_SET)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-        return image_ID;
-    }
-
-    if (1 != fread(&hotx, sizeof(hotx), 1, fd) || 1 != fread(&hoty, sizeof(hoty), 1, fd) ||
-        1 != fread(&width, sizeof(width), 1, fd) || 1 != fread(&height, sizeof(height), 1, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        return image_ID;
-    }
-
-    hotx = GINT16_FROM_LE(hotx);
-    hoty = GINT16_FROM_LE(hoty);
-    width = GINT16_FROM_LE(width);
-    height = GINT16_FROM_LE(height);
+    band_rows = MIN(header->height, MAX(1, MAX_BAND_SIZE / header->width));
 
-    pixel_count = width * height;
-    g_assert(pixel_count > 0);
-
-    pixels = g_malloc(pixel_count);
-    palette = g_malloc(PALETTE_SIZE);
-
-    if (!pixels) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
-        return image_ID;
-    }
-
-    if (!palette) {
+    band = g_malloc((gsize)band_rows * header->width);
+    if (!band) {
         g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
-        g_free(pixels);
-        return image_ID;
-    }
-
-    if (PALETTE_SIZE != fread(palette, sizeof(guchar), PALETTE_SIZE, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        g_free(pixels);
-        g_free(palette);
-        return image_ID;
-    }
-
-    if (!image_rle_decode(fd, file_size - 8 - PALETTE_SIZE, pixels, width, height)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
-        g_free(pixels);
-        g_free(palette);
         return image_ID;
     }
 
-    image_ID = gimp_image_new(width, height, GIMP_INDEXED);
+    image_ID = gimp_image_new(header->width, header->height, GIMP_INDEXED);
     g_assert(image_ID != -1);
 
-    layer = gimp_layer_new(image_ID, "Background", width, height, GIMP_INDEXED_IMAGE, 100,
+    layer = gimp_layer_new(image_ID, "Background", header->width, header->height, GIMP_INDEXED_IMAGE, 100,
                            gimp_image_get_default_new_layer_mode(image_ID));
     result = gimp_image_insert_layer(image_ID, layer, -1, 0);
     g_assert(result);
 
+    /* the pixels are decoded one band at a time straight into the layer */
+    image_rle_decoder_init(&decoder, header->payload, header->payload_size);
     gbuffer = gimp_drawable_get_buffer(layer);
-    gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, 0, width, height), 0, NULL, pixels, GEGL_AUTO_ROWSTRIDE);
-    g_object_unref(gbuffer);
-
-    result = gimp_image_set_colormap(image_ID, palette, PALETTE_COLORS);
-    g_assert(result);
-
-    g_free(pixels);
-    g_free(palette);
-    return image_ID;
-}
 
-gboolean decode_max_multi_image(FILE *fd, struct MaxMultiImage *image) {
-    for (gint i = 0; i < image->height; ++i) {
-        guchar transparent_count = 0;
-        guchar pixel_count = 0;
-        gint offset = 0;
+    for (gint y = 0; y < header->height; y += band_rows) {
+        gint rows = MIN(band_rows, header->height - y);
 
-        if (ftell(fd) != image->rows[i]) {
-            return FALSE;
+        if (!image_rle_decoder_read(&decoder, band, (gsize)rows * header->width)) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
+            decoded = FALSE;
+            break;
         }
 
-        for (;;) {
-            fread(&transparent_count, sizeof(transparent_count), 1, fd);
-            if (transparent_count == 0xFF) {
-                break;
-            }
-
-            fread(&pixel_count, sizeof(pixel_count), 1, fd);
-            offset += transparent_count;
-            fread(&image->pixels[offset + i * image->width], sizeof(guchar), pixel_count, fd);
-            offset += pixel_count;
-        }
+        gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, y, header->width, rows), 0, NULL, band, GEGL_AUTO_ROWSTRIDE);
     }
 
-    return TRUE;
-}
+    g_object_unref(gbuffer);
+    g_free(band);
 
-gboolean decode_max_multi_shadow(FILE *fd, struct MaxMultiImage *image) {
-    for (gint i = 0; i < image->height; ++i) {
-        guchar transparent_count = 0;
-        guchar shadow_count = 0;
-        gint offset = 0;
+    if (!decoded) {
+        gimp_image_delete(image_ID);
+        return -1;
+    }
 
-        if (ftell(fd) != image->rows[i]) {
-            return FALSE;
-        }
+    result = gimp_image_set_colormap(image_ID, header->palette, PALETTE_COLORS);
+    g_assert(result);
 
-        for (;;) {
-            fread(&transparent_count, sizeof(transparent_count), 1, fd);
-            if (transparent_count == 0xFF) {
-                break;
-            }
+    return image_ID;
+}
 
-            fread(&shadow_count, sizeof(shadow_count), 1, fd);
-            offset += transparent_count;
+gint32 load_max_multi(const guchar *data, gsize size, GError **error) {
+    struct MaxMulti *multi;
+    gint32 image_ID = -1;
+    gint32 layer;
+    GeglBuffer *gbuffer;
+    gboolean result;
 
-            if (offset + i * image->width + shadow_count > image->width * image->height) {
-                return FALSE;
-            }
+    gint32 image_ulx = 0;
+    gint32 image_uly = 0;
+    gint32 image_lrx = 0;
+    gint32 image_lry = 0;
 
-            memset(&image->pixels[offset + i * image->width], 20, shadow_count);
-            offset += shadow_count;
-        }
+    multi = decode_max_multi(data, size, error);
+    if (!multi) {
+        return image_ID;
     }
 
-    return TRUE;
-}
+    for (int i = 0; i < multi->image_count; ++i) {
+        image_ulx = MAX(multi->images[i]->hotx, image_ulx);
+        image_uly = MAX(multi->images[i]->hoty, image_uly);
+        image_lrx = MAX(multi->images[i]->width - multi->images[i]->hotx, image_lrx);
+        image_lry = MAX(multi->images[i]->height - multi->images[i]->hoty, image_lry);
+    }
 
-gpointer read_max_multi_image(FILE *fd, guint32 address) {
-    static gboolean decoder_mode = TRUE;
-    struct MaxMultiImage *image;
+    image_ID = gimp_image_new(image_ulx + image_lrx, image_uly + image_lry, GIMP_INDEXED);
+    g_assert(image_ID != -1);
 
-    image = g_malloc(sizeof(struct MaxMultiImage));
-    if (!image) {
-        return NULL;
-    }
+    result = gimp_image_set_colormap(image_ID, max_default_palette, PALETTE_COLORS);
+    g_assert(result);
 
-    memset(image, 0, sizeof(struct MaxMultiImage));
+    for (int i = 0; i < multi->image_count; ++i) {
+        struct MaxMultiImage *image = multi->images[i];
+        gchar layer_name[10];
+        guchar hotspot[2 * sizeof(gint16)];
+        GimpParasite *parasite;
 
-    image->file_offset = address;
+        snprintf(layer_name, sizeof(layer_name), "layer %i", i);
 
-    if (0 != fseek(fd, image->file_offset, SEEK_SET)) {
-        g_free(image);
-        return NULL;
-    }
+        layer = gimp_layer_new(image_ID, layer_name, image->width, image->height, GIMP_INDEXEDA_IMAGE, 100,
+                               gimp_image_get_default_new_layer_mode(image_ID));
+        result = gimp_image_insert_layer(image_ID, layer, -1, i);
+        g_assert(result);
 
-    if (1 != fread(&image->width, sizeof(image->width), 1, fd) ||
-        1 != fread(&image->height, sizeof(image->height), 1, fd) ||
-        1 != fread(&image->hotx, sizeof(image->hotx), 1, fd) || 1 != fread(&image->hoty, sizeof(image->hoty), 1, fd)) {
-        g_free(image);
-        return NULL;
-    }
+        result = gimp_layer_set_offsets(layer, image_ulx - image->hotx, image_uly - image->hoty);
+        g_assert(result);
 
-    image->width = GINT16_FROM_LE(image->width);
-    image->height = GINT16_FROM_LE(image->height);
-    image->hotx = GINT16_FROM_LE(image->hotx);
-    image->hoty = GINT16_FROM_LE(image->hoty);
+        /* the hotspot relative to the layer origin is kept for export */
+        max_put_int16(&hotspot[0], image->hotx);
+        max_put_int16(&hotspot[2], image->hoty);
+        parasite = gimp_parasite_new(HOTSPOT_PARASITE, GIMP_PARASITE_PERSISTENT, sizeof(hotspot), hotspot);
+        gimp_item_attach_parasite(layer, parasite);
+        gimp_parasite_free(parasite);
 
-    image->rows = g_malloc(sizeof(gint32) * image->height);
-    if (!image->rows) {
-        g_free(image);
-        return NULL;
+        gbuffer = gimp_drawable_get_buffer(layer);
+        gegl_buffer_set(gbuffer, GEGL_RECTANGLE(0, 0, image->width, image->height), 0, NULL, image->pixels,
+                        GEGL_AUTO_ROWSTRIDE);
+        g_object_unref(gbuffer);
     }
 
-    for (gint i = 0; i < image->height; ++i) {
-        gint32 row_address;
+    max_multi_free(multi);
 
-        if (1 != fread(&row_address, sizeof(row_address), 1, fd)) {
-            g_free(image->rows);
-            g_free(image);
-            return NULL;
-        }
+    return image_ID;
+}
 
-        image->rows[i] = GUINT32_FROM_LE(row_address);
+void on_dialog_response(GtkWidget *widget, gint response_id, gpointer data) {
+    if (response_id == GTK_RESPONSE_OK) {
+        *(gboolean *)data = TRUE;
     }
 
-    image->pixels = g_malloc(image->width * image->height);
-    if (!image->pixels) {
-        g_free(image->rows);
-        g_free(image);
-        return NULL;
-    }
+    gtk_widget_destroy(widget);
+}
 
-    memset(image->pixels, 0, image->width * image->height);
+void on_combo_changed(GtkComboBox *combo_box) { max_settings.file_type = gtk_combo_box_get_active(combo_box); }
 
-    if (decoder_mode) {
-        gint32 restore_point;
+void on_compression_changed(GtkComboBox *combo_box) { max_settings.rle_mode = gtk_combo_box_get_active(combo_box); }
 
-        restore_point = ftell(fd);
-        if (restore_point == -1) {
-            g_free(image);
-            return NULL;
-        }
-
-        if (!decode_max_multi_shadow(fd, image)) {
-            if (0 != fseek(fd, restore_point, SEEK_SET)) {
-                g_free(image);
-                return NULL;
-            }
-            decoder_mode = FALSE;
-        }
-    }
-
-    if (!decoder_mode) {
-        if (!decode_max_multi_image(fd, image)) {
-            g_free(image->pixels);
-            g_free(image->rows);
-            g_free(image);
-            return NULL;
-        }
-    }
-
-    return image;
-}
-
-gint32 load_max_multi(FILE *fd, GError **error) {
-    guint32 *offsets = NULL;
-    struct MaxMultiImage **images = NULL;
-    gint pixel_count = -1;
-    gint32 image_ID = -1;
-    gint32 layer;
-    GeglBuffer *gbuffer;
-    gint16 image_count = 0;
-    gboolean result;
-
-    gint32 image_ulx = 0;
-    gint32 image_uly = 0;
-    gint32 image_lrx = 0;
-    gint32 image_lry = 0;
-
-    gint palette_colors = 0;
-    guchar *palette = NULL;
-    GimpRGB transparent_color;
-
-    if (0 != fseek(fd, 0, SEEK_SET)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File seek error.");
-        return image_ID;
-    }
-
-    if (1 != fread(&image_count, sizeof(image_count), 1, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        return image_ID;
-    }
-
-    image_count = GINT32_FROM_LE(image_count);
-
-    offsets = g_malloc(image_count * sizeof(guint32));
-    if (!offsets) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
-        return image_ID;
-    }
-
-    if (image_count != fread(offsets, sizeof(guint32), image_count, fd)) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
-        g_free(offsets);
-        return image_ID;
-    }
-
-    images = g_malloc(image_count * sizeof(struct MaxMultiImage *));
-    if (!images) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
-        g_free(offsets);
-        return image_ID;
-    }
-
-    for (gint i = 0; i < image_count; ++i) {
-        if (ftell(fd) != offsets[i]) {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
-            /** \todo Free images */
-            g_free(offsets);
-            return -1;
-        }
-
-        images[i] = read_max_multi_image(fd, offsets[i]);
-        if (!images[i]) {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
-            /** \todo Free images */
-            g_free(offsets);
-            return -1;
-        }
-    }
-
-    for (int i = 0; i < image_count; ++i) {
-        image_ulx = MAX(images[i]->hotx, image_ulx);
-        image_uly = MAX(images[i]->hoty, image_uly);
-        image_lrx = MAX(images[i]->width - images[i]->hotx, image_lrx);
-        image_lry = MAX(images[i]->height - images[i]->hoty, image_lry);
-    }
-
-    image_ID = gimp_image_new(image_ulx + image_lrx, image_uly + image_lry, GIMP_INDEXED);
-    g_assert(image_ID != -1);
-
-    result = gimp_image_set_colormap(image_ID, max_default_palette, PALETTE_COLORS);
-    g_assert(result);
-
-    palette = gimp_image_get_colormap(image_ID, &palette_colors);
-    transparent_color.r = palette[0];
-    transparent_color.g = palette[1];
-    transparent_color.b = palette[2];
-    transparent_color.a = 0;
-
-    for (int i = 0; i < image_count; ++i) {
-        gchar layer_name[10];
-        GeglBuffer *gbuffer_layer;
-        gint palette_colors;
-
-        snprintf(layer_name, sizeof(layer_name), "layer %i", i);
-
-        layer = gimp_layer_new(image_ID, layer_name, image_ulx + image_lrx, image_uly + image_lry, GIMP_INDEXED_IMAGE,
-                               100, gimp_image_get_default_new_layer_mode(image_ID));
-        result = gimp_image_insert_layer(image_ID, layer, -1, i);
-        g_assert(result);
+void on_palette_changed(GtkComboBox *combo_box) { max_settings.palette_mode = gtk_combo_box_get_active(combo_box); }
 
-        gbuffer = gimp_drawable_get_buffer(layer);
-        gbuffer_layer = gegl_buffer_linear_new_from_data(images[i]->pixels, gimp_drawable_get_format(layer),
-                                                         GEGL_RECTANGLE(0, 0, images[i]->width, images[i]->height),
-                                                         GEGL_AUTO_ROWSTRIDE, NULL, NULL);
-
-        gegl_buffer_copy(gbuffer_layer, GEGL_RECTANGLE(0, 0, images[i]->width, images[i]->height), GEGL_ABYSS_NONE,
-                         gbuffer,
-                         GEGL_RECTANGLE(image_ulx - images[i]->hotx, image_uly - images[i]->hoty, images[i]->width,
-                                        images[i]->height));
-        g_object_unref(gbuffer_layer);
-        g_object_unref(gbuffer);
-
-        gimp_layer_add_alpha(layer);
-        if (gimp_image_select_color(image_ID, GIMP_CHANNEL_OP_REPLACE, layer, &transparent_color)) {
-            //            gimp_drawable_edit_clear(layer);
-        }
-    }
-
-    /** \todo Free images */
-    g_free(offsets);
-
-    return image_ID;
-}
-
-void on_dialog_response(GtkWidget *widget, gint response_id, gpointer data) {
-    if (response_id == GTK_RESPONSE_OK) {
-        *(gboolean *)data = TRUE;
-    }
-
-    gtk_widget_destroy(widget);
-}
-
-void on_combo_changed(GtkComboBox *combo_box) { max_settings.file_type = gtk_combo_box_get_active(combo_box); }
+void on_dither_changed(GtkComboBox *combo_box) { max_settings.dither_mode = gtk_combo_box_get_active(combo_box); }
 
 gboolean save_dialog(gint32 image_ID, GError **error) {
     GtkWidget *dialog = NULL;
@@ -998,6 +720,36 @@ gboolean save_dialog(gint32 image_ID, GError **error) {
     gtk_combo_box_set_active(GTK_COMBO_BOX(combo), max_settings.file_type);
     g_signal_connect(combo, "changed", G_CALLBACK(on_combo_changed), &max_settings);
 
+    combo = GTK_WIDGET(gtk_builder_get_object(builder, "compression-combo"));
+    if (!combo) {
+        g_object_unref(builder);
+        gtk_widget_destroy(dialog);
+        return FALSE;
+    }
+
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), max_settings.rle_mode);
+    g_signal_connect(combo, "changed", G_CALLBACK(on_compression_changed), &max_settings);
+
+    combo = GTK_WIDGET(gtk_builder_get_object(builder, "palette-combo"));
+    if (!combo) {
+        g_object_unref(builder);
+        gtk_widget_destroy(dialog);
+        return FALSE;
+    }
+
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), max_settings.palette_mode);
+    g_signal_connect(combo, "changed", G_CALLBACK(on_palette_changed), &max_settings);
+
+    combo = GTK_WIDGET(gtk_builder_get_object(builder, "dither-combo"));
+    if (!combo) {
+        g_object_unref(builder);
+        gtk_widget_destroy(dialog);
+        return FALSE;
+    }
+
+    gtk_combo_box_set_active(GTK_COMBO_BOX(combo), max_settings.dither_mode);
+    g_signal_connect(combo, "changed", G_CALLBACK(on_dither_changed), &max_settings);
+
     gtk_widget_show(dialog);
     gtk_main();
 
@@ -1006,25 +758,42 @@ gboolean save_dialog(gint32 image_ID, GError **error) {
     return result;
 }
 
-GimpPDBStatusType save_max_simple(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
-                                  GError **error) {
+gboolean save_max_write(const gchar *filename, struct MaxWriter *writer, GError **error) {
     FILE *fd;
-    gpointer buffer = NULL;
-    GeglBuffer *gbuffer = NULL;
+    gboolean result = TRUE;
+
+    fd = g_fopen(filename, "wb");
+    if (!fd) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for writing: %s",
+                    gimp_filename_to_utf8(filename), g_strerror(errno));
+        return FALSE;
+    }
+
+    if (!max_writer_flush(writer, fd)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        result = FALSE;
+    }
+
+    if (EOF == fclose(fd) && result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to close '%s'.", gimp_filename_to_utf8(filename));
+        result = FALSE;
+    }
+
+    return result;
+}
+
+/**
+ * Fills in the size and the palette of the image and returns the pixel format to read the drawable with. The pixels
+ * are read by save_max_stream(). True color drawables are read as RGB and mapped to the game palette, alpha is
+ * dropped as neither format can store it.
+ */
+const Babl *save_max_get_image(gint32 image, gint32 drawable_ID, struct MaxImage *max_image, GError **error) {
     GimpImageType drawable_type;
     gint drawable_width = -1;
     gint drawable_height = -1;
     const Babl *format = NULL;
-    guchar *g_palette;
+    guchar *g_palette = NULL;
     gint num_colors = -1;
-    gint buffer_size = 0;
-    gushort width;
-    gushort height;
-    gushort hotx;
-    gushort hoty;
-
-    gbuffer = gimp_drawable_get_buffer(drawable_ID);
-    g_assert(gbuffer);
 
     drawable_width = gimp_drawable_width(drawable_ID);
     drawable_height = gimp_drawable_height(drawable_ID);
@@ -1032,23 +801,25 @@ GimpPDBStatusType save_max_simple(const gchar *filename, gint32 image, gint32 dr
     if (drawable_width > G_MAXINT16 || drawable_height > G_MAXINT16) {
         g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
                     drawable_width, drawable_height);
-        return GIMP_PDB_EXECUTION_ERROR;
+        return NULL;
     }
 
-    width = drawable_width;
-    height = drawable_height;
+    max_image->width = drawable_width;
+    max_image->height = drawable_height;
 
     /** \todo Implement image settings */
-    hotx = 0;
-    hoty = 0;
+    max_image->hotx = 0;
+    max_image->hoty = 0;
 
     drawable_type = gimp_drawable_type(drawable_ID);
 
     switch (drawable_type) {
-        case GIMP_RGB_IMAGE: {
-        } break;
-
+        case GIMP_RGB_IMAGE:
         case GIMP_RGBA_IMAGE: {
+            format = babl_format("R'G'B' u8");
+            g_palette = g_malloc(PALETTE_SIZE);
+            memcpy(g_palette, max_default_palette, PALETTE_SIZE);
+            num_colors = PALETTE_COLORS;
         } break;
 
         case GIMP_GRAY_IMAGE: {
@@ -1071,150 +842,545 @@ GimpPDBStatusType save_max_simple(const gchar *filename, gint32 image, gint32 dr
         }
     }
 
-    gimp_progress_init_printf("Exporting '%s'", gimp_filename_to_utf8(filename));
+    if (!format) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Unsupported drawable type.");
+        return NULL;
+    }
+
+    max_image->palette = g_malloc0(PALETTE_SIZE);
+
+    if (!max_image->palette) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        g_free(g_palette);
+        return NULL;
+    }
+
+    memcpy(max_image->palette, g_palette, MIN(num_colors * 3, PALETTE_SIZE));
+    g_free(g_palette);
+
+    return format;
+}
+
+/**
+ * Fits the palette to a true color drawable. The drawable is read in bands, every band is counted into the histogram
+ * on a thread pool.
+ */
+void save_max_get_palette(gint32 drawable_ID, const Babl *format, guchar *palette) {
+    struct MaxHistogram *histogram;
+    GeglBuffer *gbuffer;
+    guchar *pixels;
+    gint width = gimp_drawable_width(drawable_ID);
+    gint height = gimp_drawable_height(drawable_ID);
+    gint bpp = babl_format_get_bytes_per_pixel(format);
+    gint band_rows = MAX(1, MAX_BAND_SIZE / width);
+    gint first_color = 0;
+
+    histogram = max_histogram_new();
+    gbuffer = gimp_drawable_get_buffer(drawable_ID);
+    pixels = g_malloc((gsize)band_rows * width * bpp);
+
+    for (gint y = 0; y < height; y += band_rows) {
+        gint rows = MIN(band_rows, height - y);
+
+        gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, y, width, rows), 1.0, format, pixels, GEGL_AUTO_ROWSTRIDE,
+                        GEGL_ABYSS_NONE);
+        max_histogram_add(histogram, pixels, bpp, (gsize)rows * width);
+    }
+
+    g_free(pixels);
+    g_object_unref(gbuffer);
+
+    memcpy(palette, max_default_palette, PALETTE_SIZE);
+
+    if (max_settings.palette_mode == MAX_PALETTE_RESERVED) {
+        first_color = MAX_PALETTE_RESERVED_COLORS;
+    }
+
+    max_palette_generate(histogram, palette, first_color, PALETTE_COLORS - first_color);
+    max_histogram_free(histogram);
+}
+
+gpointer save_max_read_band(gpointer data) {
+    struct MaxBand *band = data;
+
+    gegl_buffer_get(band->gbuffer, GEGL_RECTANGLE(0, band->y, band->width, band->rows), 1.0, band->format,
+                    band->pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+
+    if (band->dither) {
+        max_dither_apply(band->dither, band->pixels, babl_format_get_bytes_per_pixel(band->format), band->indices,
+                         band->y, band->rows);
+    }
+
+    return NULL;
+}
+
+/**
+ * Encodes the drawable in bands of rows straight to the file. The next band, plus the row after it that the greedy
+ * RLE mode looks ahead into, is read from GEGL on a worker thread while the current band is encoded. Only two bands
+ * are held in memory whatever the size of the image.
+ */
+gboolean save_max_stream(const gchar *filename, gint32 drawable_ID, const struct MaxImage *max_image,
+                         const Babl *format, gint file_type, GError **error) {
+    struct MaxWriter writer;
+    struct MaxBand bands[2];
+    GeglBuffer *gbuffer;
+    GThread *thread = NULL;
+    struct MaxPaletteMap *map = NULL;
+    struct MaxDither *dither = NULL;
+    FILE *fd;
+    gint band_rows = MAX(1, RLE_SMALLEST_CHUNK_SIZE / max_image->width);
+    gint bpp = babl_format_get_bytes_per_pixel(format);
+    gboolean result;
 
     fd = g_fopen(filename, "wb");
     if (!fd) {
         g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for writing: %s",
                     gimp_filename_to_utf8(filename), g_strerror(errno));
-        return GIMP_PDB_EXECUTION_ERROR;
+        return FALSE;
     }
 
-    buffer_size = drawable_width * drawable_height * sizeof(guchar);
-    buffer = g_malloc(buffer_size);
-    if (!buffer) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory (%i).", buffer_size);
+    max_writer_init(&writer, fd);
+
+    if (file_type == MAX_FORMAT_SIMPLE) {
+        result = encode_max_simple_header(&writer, max_image, error);
     } else {
-        gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, 0, drawable_width, drawable_height), 1.0, format, buffer,
-                        GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
-        g_object_unref(gbuffer);
+        result = encode_max_big_header(&writer, max_image, error);
+    }
 
-        if (1 == fwrite(&width, sizeof(width), 1, fd) && 1 == fwrite(&height, sizeof(height), 1, fd) &&
-            1 == fwrite(&hotx, sizeof(hotx), 1, fd) && 1 == fwrite(&hoty, sizeof(hoty), 1, fd) &&
-            buffer_size == fwrite(buffer, sizeof(guchar), buffer_size, fd)) {
+    gbuffer = gimp_drawable_get_buffer(drawable_ID);
+    g_assert(gbuffer);
+
+    if (bpp > 1) {
+        /* reserved entries of a fitted palette are kept out of the mapping */
+        gint first_color = file_type == MAX_FORMAT_BIG && max_settings.palette_mode == MAX_PALETTE_RESERVED
+                               ? MAX_PALETTE_RESERVED_COLORS
+                               : 0;
+
+        map = max_palette_map_new(max_image->palette, first_color,
+                                  !memcmp(max_image->palette, max_default_palette, PALETTE_SIZE));
+        dither = max_dither_new(map, max_settings.dither_mode, max_image->width, 0);
+    }
+
+    for (gint i = 0; i < 2; ++i) {
+        bands[i].gbuffer = gbuffer;
+        bands[i].format = format;
+        bands[i].dither = dither;
+        bands[i].width = max_image->width;
+        bands[i].pixels = g_malloc((gsize)(band_rows + 1) * max_image->width * bpp);
+        bands[i].indices = dither ? g_malloc((gsize)(band_rows + 1) * max_image->width) : bands[i].pixels;
+    }
+
+    bands[0].y = 0;
+    bands[0].rows = MIN(band_rows + 1, max_image->height);
+
+    if (result) {
+        thread = g_thread_new("max-band-reader", save_max_read_band, &bands[0]);
+    }
+
+    for (gint y = 0, i = 0; result && y < max_image->height; y += band_rows, i ^= 1) {
+        gint rows = MIN(band_rows, max_image->height - y);
+        gboolean lookahead = y + rows < max_image->height;
+
+        g_thread_join(thread);
+        thread = NULL;
+
+        /* the reader thread talks to the core as well, progress is only reported while it is idle */
+        gimp_progress_update((gdouble)y / max_image->height);
+
+        if (lookahead) {
+            bands[i ^ 1].y = y + rows;
+            bands[i ^ 1].rows = MIN(band_rows + 1, max_image->height - y - rows);
+            thread = g_thread_new("max-band-reader", save_max_read_band, &bands[i ^ 1]);
+        }
+
+        if (file_type == MAX_FORMAT_SIMPLE) {
+            if (!max_writer_append(&writer, bands[i].indices, (gsize)rows * max_image->width)) {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+                result = FALSE;
+            }
         } else {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+            result = encode_max_big_rows(&writer, bands[i].indices, rows, max_image->width, lookahead,
+                                         max_settings.rle_mode, error);
         }
     }
 
-    g_free(buffer);
-    if (EOF == fclose(fd)) {
+    if (thread) {
+        g_thread_join(thread);
+    }
+
+    if (result && !max_writer_flush(&writer, fd)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        result = FALSE;
+    }
+
+    if (EOF == fclose(fd) && result) {
         g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to close '%s'.", gimp_filename_to_utf8(filename));
+        result = FALSE;
+    }
+
+    if (!result) {
+        g_unlink(filename);
     }
 
-    return GIMP_PDB_SUCCESS;
+    for (gint i = 0; i < 2; ++i) {
+        if (bands[i].indices != bands[i].pixels) {
+            g_free(bands[i].indices);
+        }
+
+        g_free(bands[i].pixels);
+    }
+
+    max_dither_free(dither);
+    max_palette_map_free(map);
+    g_object_unref(gbuffer);
+    max_writer_free(&writer);
+
+    return result;
+}
+
+GimpPDBStatusType save_max_simple(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
+                                  GError **error) {
+    struct MaxImage max_image = {0};
+    const Babl *format;
+    GimpPDBStatusType status = GIMP_PDB_EXECUTION_ERROR;
+
+    gimp_progress_init_printf("Exporting '%s'", gimp_filename_to_utf8(filename));
+
+    format = save_max_get_image(image, drawable_ID, &max_image, error);
+
+    if (format && save_max_stream(filename, drawable_ID, &max_image, format, MAX_FORMAT_SIMPLE, error)) {
+        status = GIMP_PDB_SUCCESS;
+    }
+
+    g_free(max_image.palette);
+
+    return status;
 }
 
 GimpPDBStatusType save_max_big(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
                                GError **error) {
-    FILE *fd;
-    gpointer buffer = NULL;
-    GeglBuffer *gbuffer = NULL;
-    GimpImageType drawable_type;
-    gint drawable_width = -1;
-    gint drawable_height = -1;
-    const Babl *format = NULL;
-    guchar *g_palette;
-    gint num_colors = -1;
-    gint buffer_size = 0;
-    gushort width;
-    gushort height;
-    gushort hotx;
-    gushort hoty;
+    struct MaxImage max_image = {0};
+    const Babl *format;
+    GimpPDBStatusType status = GIMP_PDB_EXECUTION_ERROR;
 
-    gbuffer = gimp_drawable_get_buffer(drawable_ID);
-    g_assert(gbuffer);
+    gimp_progress_init_printf("Exporting '%s'", gimp_filename_to_utf8(filename));
 
-    drawable_width = gimp_drawable_width(drawable_ID);
-    drawable_height = gimp_drawable_height(drawable_ID);
+    format = save_max_get_image(image, drawable_ID, &max_image, error);
 
-    if (drawable_width > G_MAXINT16 || drawable_height > G_MAXINT16) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
-                    drawable_width, drawable_height);
-        return GIMP_PDB_EXECUTION_ERROR;
+    /* only Big files carry a palette, Simple exports always use the game palette */
+    if (format && babl_format_get_bytes_per_pixel(format) > 1 && max_settings.palette_mode != MAX_PALETTE_GAME) {
+        save_max_get_palette(drawable_ID, format, max_image.palette);
     }
 
-    width = drawable_width;
-    height = drawable_height;
+    if (format && save_max_stream(filename, drawable_ID, &max_image, format, MAX_FORMAT_BIG, error)) {
+        status = GIMP_PDB_SUCCESS;
+    }
 
-    /** \todo Implement image settings */
-    hotx = 0;
-    hoty = 0;
+    g_free(max_image.palette);
 
-    drawable_type = gimp_drawable_type(drawable_ID);
+    return status;
+}
 
-    switch (drawable_type) {
-        case GIMP_RGB_IMAGE: {
-        } break;
+/**
+ * Collects every layer as a frame. The hotspot is taken from the layer parasite written by the loader, otherwise the
+ * canvas origin is used. True color layers are mapped to the game palette with the selected
+ * dithering, pixels with any alpha are kept opaque.
+ */
+struct MaxMulti *save_max_get_frames(gint32 image, GError **error) {
+    struct MaxMulti *multi;
+    struct MaxPaletteMap *map = NULL;
+    gint32 *layers;
+    gint num_layers = 0;
+    gboolean result = TRUE;
+
+    layers = gimp_image_get_layers(image, &num_layers);
+
+    if (num_layers <= 0 || num_layers > G_MAXINT16) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (layers: %i).", num_layers);
+        g_free(layers);
+        return NULL;
+    }
 
-        case GIMP_RGBA_IMAGE: {
-        } break;
+    multi = g_malloc0(sizeof(struct MaxMulti));
+    multi->images = g_malloc0(num_layers * sizeof(struct MaxMultiImage *));
+    multi->image_count = num_layers;
+
+    for (gint i = 0; i < num_layers; ++i) {
+        struct MaxMultiImage *frame;
+        GimpImageType drawable_type;
+        GimpParasite *parasite;
+        GeglBuffer *gbuffer;
+        struct MaxDither *dither;
+        guchar *rgba = NULL;
+        gint width = gimp_drawable_width(layers[i]);
+        gint height = gimp_drawable_height(layers[i]);
+        gint offset_x;
+        gint offset_y;
+
+        drawable_type = gimp_drawable_type(layers[i]);
+
+        if (drawable_type != GIMP_INDEXED_IMAGE && drawable_type != GIMP_INDEXEDA_IMAGE &&
+            drawable_type != GIMP_RGB_IMAGE && drawable_type != GIMP_RGBA_IMAGE) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Unsupported drawable type.");
+            result = FALSE;
+            break;
+        }
 
-        case GIMP_GRAY_IMAGE: {
-        } break;
+        if (width > G_MAXINT16 || height > G_MAXINT16) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
+                        width, height);
+            result = FALSE;
+            break;
+        }
 
-        case GIMP_GRAYA_IMAGE: {
-        } break;
+        frame = g_malloc0(sizeof(struct MaxMultiImage));
+        multi->images[i] = frame;
 
-        case GIMP_INDEXED_IMAGE: {
-            format = gimp_drawable_get_format(drawable_ID);
-            g_palette = gimp_image_get_colormap(image, &num_colors);
+        frame->width = width;
+        frame->height = height;
+        frame->pixels = g_malloc(MULTI_PIXEL_SIZE * width * height);
 
-        } break;
+        gimp_drawable_offsets(layers[i], &offset_x, &offset_y);
 
-        case GIMP_INDEXEDA_IMAGE: {
-        } break;
+        parasite = gimp_item_get_parasite(layers[i], HOTSPOT_PARASITE);
 
-        default: {
-            g_assert_not_reached();
+        if (parasite && gimp_parasite_data_size(parasite) == 2 * sizeof(gint16)) {
+            frame->hotx = max_get_int16(gimp_parasite_data(parasite));
+            frame->hoty = max_get_int16((const guchar *)gimp_parasite_data(parasite) + sizeof(gint16));
+        } else {
+            frame->hotx = -offset_x;
+            frame->hoty = -offset_y;
+        }
+
+        gimp_parasite_free(parasite);
+
+        gbuffer = gimp_drawable_get_buffer(layers[i]);
+
+        if (drawable_type == GIMP_RGB_IMAGE || drawable_type == GIMP_RGBA_IMAGE) {
+            if (!map) {
+                map = max_palette_map_new(max_default_palette, 0, TRUE);
+            }
+
+            rgba = g_malloc((gsize)4 * width * height);
+            gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, 0, width, height), 1.0, babl_format("R'G'B'A u8"), rgba,
+                            GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+            dither = max_dither_new(map, max_settings.dither_mode, width, 0);
+            max_dither_apply(dither, rgba, 4, frame->pixels, 0, height);
+            max_dither_free(dither);
+
+        } else {
+            gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, 0, width, height), 1.0, gimp_drawable_get_format(layers[i]),
+                            frame->pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+        }
+
+        g_object_unref(gbuffer);
+
+        /* layers without alpha are expanded in place to index and alpha pairs */
+        if (rgba) {
+            for (gint j = width * height - 1; j >= 0; --j) {
+                frame->pixels[MULTI_PIXEL_SIZE * j] = frame->pixels[j];
+                frame->pixels[MULTI_PIXEL_SIZE * j + 1] = rgba[4 * j + 3] ? 0xFF : 0;
+            }
+
+            g_free(rgba);
+
+        } else if (drawable_type == GIMP_INDEXED_IMAGE) {
+            for (gint j = width * height - 1; j >= 0; --j) {
+                frame->pixels[MULTI_PIXEL_SIZE * j] = frame->pixels[j];
+                frame->pixels[MULTI_PIXEL_SIZE * j + 1] = 0xFF;
+            }
         }
     }
 
+    max_palette_map_free(map);
+    g_free(layers);
+
+    if (!result) {
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    return multi;
+}
+
+GimpPDBStatusType save_max_multi(const gchar *filename, gint32 image, GimpRunMode run_mode, GError **error) {
+    struct MaxMulti *multi;
+    struct MaxWriter writer;
+    GimpPDBStatusType status = GIMP_PDB_EXECUTION_ERROR;
+
     gimp_progress_init_printf("Exporting '%s'", gimp_filename_to_utf8(filename));
 
-    fd = g_fopen(filename, "wb");
-    if (!fd) {
-        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for writing: %s",
-                    gimp_filename_to_utf8(filename), g_strerror(errno));
-        return GIMP_PDB_EXECUTION_ERROR;
+    multi = save_max_get_frames(image, error);
+
+    if (multi) {
+        max_writer_init(&writer, NULL);
+
+        if (encode_max_multi(&writer, multi, error) && save_max_write(filename, &writer, error)) {
+            status = GIMP_PDB_SUCCESS;
+        }
+
+        max_writer_free(&writer);
+        max_multi_free(multi);
     }
 
-    buffer_size = drawable_width * drawable_height * sizeof(guchar);
-    buffer = g_malloc(buffer_size);
-    if (!buffer) {
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory (%i).", buffer_size);
+    return status;
+}
+
+/**
+ * Shadows are exported from the alpha of the layers, every opaque pixel is written as shadow.
+ */
+GimpPDBStatusType save_max_shadow(const gchar *filename, gint32 image, GimpRunMode run_mode, GError **error) {
+    struct MaxMulti *multi;
+    struct MaxWriter writer;
+    GimpPDBStatusType status = GIMP_PDB_EXECUTION_ERROR;
+
+    gimp_progress_init_printf("Exporting '%s'", gimp_filename_to_utf8(filename));
+
+    multi = save_max_get_frames(image, error);
+
+    if (multi) {
+        max_writer_init(&writer, NULL);
+
+        if (encode_max_shadow(&writer, multi, error) && save_max_write(filename, &writer, error)) {
+            status = GIMP_PDB_SUCCESS;
+        }
+
+        max_writer_free(&writer);
+        max_multi_free(multi);
+    }
+
+    return status;
+}
+
+/**
+ * Picks the format for MAX_FORMAT_AUTO. Layered images and images with alpha need the Multi format. Single layer
+ * images use Big if their palette differs from the game palette, otherwise the smaller of Simple and Big is taken.
+ * True color images use Big if a fitted palette is requested, otherwise they are estimated after mapping them to the
+ * game palette with the selected dithering. Every sampled row is dithered on its own, as its neighbors are not read.
+ * The Big size is extrapolated from the RLE cost of AUTO_SAMPLE_ROWS evenly spaced rows.
+ */
+gint save_max_select_format(gint32 image, gint32 drawable_ID) {
+    GimpImageType drawable_type;
+    GeglBuffer *gbuffer;
+    const Babl *format;
+    struct MaxPaletteMap *map = NULL;
+    guchar *g_palette;
+    guchar *pixels;
+    guchar *indices = NULL;
+    gint32 *layers;
+    gint num_layers = 0;
+    gint num_colors = 0;
+    gint width;
+    gint height;
+    gint rows;
+    gsize estimate = 0;
+    gsize simple_size;
+    gsize big_size;
+
+    layers = gimp_image_get_layers(image, &num_layers);
+    g_free(layers);
+
+    drawable_type = gimp_drawable_type(drawable_ID);
+
+    if (num_layers > 1 || gimp_drawable_has_alpha(drawable_ID)) {
+        return MAX_FORMAT_MULTI;
+    }
+
+    if (drawable_type == GIMP_INDEXED_IMAGE) {
+        g_palette = gimp_image_get_colormap(image, &num_colors);
+
+        if (num_colors > PALETTE_COLORS || memcmp(g_palette, max_default_palette, num_colors * 3)) {
+            g_free(g_palette);
+            return MAX_FORMAT_BIG;
+        }
+
+        g_free(g_palette);
+
+    } else if (drawable_type != GIMP_RGB_IMAGE || max_settings.palette_mode != MAX_PALETTE_GAME) {
+        return MAX_FORMAT_BIG;
+    }
+
+    width = gimp_drawable_width(drawable_ID);
+    height = gimp_drawable_height(drawable_ID);
+    rows = MIN(height, AUTO_SAMPLE_ROWS);
+
+    if (width <= 0 || rows <= 0) {
+        return MAX_FORMAT_SIMPLE;
+    }
+
+    if (drawable_type == GIMP_RGB_IMAGE) {
+        format = babl_format("R'G'B' u8");
+        map = max_palette_map_new(max_default_palette, 0, TRUE);
+        indices = g_malloc(width);
     } else {
-        gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, 0, drawable_width, drawable_height), 1.0, format, buffer,
+        format = gimp_drawable_get_format(drawable_ID);
+    }
+
+    gbuffer = gimp_drawable_get_buffer(drawable_ID);
+    pixels = g_malloc(width * babl_format_get_bytes_per_pixel(format));
+
+    for (gint i = 0; i < rows; ++i) {
+        gint y = (gint)(((gint64)i * height + height / 2) / rows);
+
+        gegl_buffer_get(gbuffer, GEGL_RECTANGLE(0, MIN(y, height - 1), width, 1), 1.0, format, pixels,
                         GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
-        g_object_unref(gbuffer);
 
-        if (1 == fwrite(&hotx, sizeof(hotx), 1, fd) && 1 == fwrite(&hoty, sizeof(hoty), 1, fd) &&
-            1 == fwrite(&width, sizeof(width), 1, fd) && 1 == fwrite(&height, sizeof(height), 1, fd) &&
-            num_colors * 3 == fwrite(g_palette, sizeof(guchar), num_colors * 3, fd) &&
-            image_rle_encode(fd, buffer, drawable_height, drawable_width)) {
-        } else {
-            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        if (map) {
+            struct MaxDither *dither = max_dither_new(map, max_settings.dither_mode, width, 1);
+
+            max_dither_apply(dither, pixels, babl_format_get_bytes_per_pixel(format), indices, MIN(y, height - 1), 1);
+            max_dither_free(dither);
         }
-    }
 
-    g_free(buffer);
-    if (EOF == fclose(fd)) {
-        g_clear_error(error);
-        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to close '%s'.", gimp_filename_to_utf8(filename));
+        estimate += image_rle_estimate(map ? indices : pixels, 1, width);
     }
 
-    return GIMP_PDB_SUCCESS;
+    max_palette_map_free(map);
+    g_free(indices);
+    g_free(pixels);
+    g_object_unref(gbuffer);
+
+    simple_size = 4 * sizeof(gint16) + (gsize)width * height;
+    big_size = 4 * sizeof(gint16) + PALETTE_SIZE + estimate * height / rows;
+
+    return big_size < simple_size ? MAX_FORMAT_BIG : MAX_FORMAT_SIMPLE;
 }
 
-gint32 save_max_multi(FILE *fd, GError **error) {}
+/**
+ * Checks whether the drawable alone is the image, that is the image has no other layers and the drawable covers the
+ * canvas exactly.
+ */
+gboolean save_max_is_flat(gint32 image, gint32 drawable_ID) {
+    gint num_layers;
+    gint offset_x;
+    gint offset_y;
+
+    g_free(gimp_image_get_layers(image, &num_layers));
+    gimp_drawable_offsets(drawable_ID, &offset_x, &offset_y);
+
+    return num_layers == 1 && offset_x == 0 && offset_y == 0 &&
+           gimp_drawable_width(drawable_ID) == gimp_image_width(image) &&
+           gimp_drawable_height(drawable_ID) == gimp_image_height(image);
+}
 
 GimpPDBStatusType save_image(const gchar *filename, gint32 image, gint32 drawable_ID, GimpRunMode run_mode,
                              GError **error) {
     GimpPDBStatusType result = GIMP_PDB_EXECUTION_ERROR;
+    gint file_type = max_settings.file_type;
+    gint32 flat_image = -1;
 
-    switch (max_settings.file_type) {
-        case MAX_FORMAT_AUTO: {
-        } break;
+    if (file_type == MAX_FORMAT_AUTO) {
+        file_type = save_max_select_format(image, drawable_ID);
+    }
+
+    /* layers are kept for Multi files, the single image formats get the merged canvas like before */
+    if ((file_type == MAX_FORMAT_SIMPLE || file_type == MAX_FORMAT_BIG) && !save_max_is_flat(image, drawable_ID)) {
+        flat_image = gimp_image_duplicate(image);
+        drawable_ID = gimp_image_flatten(flat_image);
+        image = flat_image;
+    }
+
+    switch (file_type) {
         case MAX_FORMAT_SIMPLE: {
             result = save_max_simple(filename, image, drawable_ID, run_mode, error);
         } break;
@@ -1222,12 +1388,18 @@ GimpPDBStatusType save_image(const gchar *filename, gint32 image, gint32 drawabl
             result = save_max_big(filename, image, drawable_ID, run_mode, error);
         } break;
         case MAX_FORMAT_MULTI: {
+            result = save_max_multi(filename, image, run_mode, error);
         } break;
         case MAX_FORMAT_SHADOW: {
+            result = save_max_shadow(filename, image, run_mode, error);
         } break;
         default: {
         } break;
     }
 
+    if (flat_image != -1) {
+        gimp_image_delete(flat_image);
+    }
+
     return result;
 }
@@ -0,0 +1,758 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "max-codec.h"
+#include "max-palette.h"
+#include "max-resource.h"
+
+#define BENCH_SYNTHETIC_COUNT 16
+#define BENCH_SYNTHETIC_SEED 0x4D4158
+#define BENCH_HOSTILE_SIZE 4
+#define BENCH_STREAM_LIMIT (1 << 20)
+#define BENCH_DITHER_WIDTH 203
+#define BENCH_DITHER_HEIGHT 77
+#define BENCH_DITHER_THREADS 4
+#define BENCH_ARCHIVE_TEMPLATE "max-bench-XXXXXX.res"
+
+typedef gboolean (*MaxBenchDecoder)(const struct MaxHeader *header, guchar *pixels);
+
+/** Big file of the corpus. The header points into data. */
+struct MaxBenchAsset {
+    gchar *name;
+    guchar *data;
+    gsize size;
+    struct MaxHeader header;
+};
+
+/** Hand made RLE payload of a BENCH_HOSTILE_SIZE square image and whether the decoders have to accept it. */
+struct MaxBenchPayload {
+    const gchar *name;
+    guchar data[24];
+    gsize size;
+    gboolean valid;
+};
+
+static gboolean bench_decode_baseline(const struct MaxHeader *header, guchar *pixels);
+static gboolean bench_decode_checked(const struct MaxHeader *header, guchar *pixels);
+static gboolean bench_decode_stream(const struct MaxHeader *header, guchar *pixels);
+static gboolean bench_add_asset(GPtrArray *corpus, const gchar *filename, guchar *data, gsize size);
+static void bench_load_path(GPtrArray *corpus, const gchar *path);
+static struct MaxImage *bench_create_sprite(GRand *rand, gint width, gint height);
+static guchar *bench_encode(const struct MaxImage *image, gint rle_mode, gsize *size);
+static void bench_create_corpus(GPtrArray *corpus);
+static gint64 bench_run(MaxBenchDecoder decoder, GPtrArray *corpus, guchar *pixels);
+static gboolean bench_check_outputs(GPtrArray *corpus, guchar *pixels, guchar *reference);
+static gboolean bench_report_encoders(GPtrArray *corpus, guchar *pixels, gsize pixel_count);
+static gboolean bench_expect(const gchar *name, const guchar *data, gsize size, gboolean valid);
+static gboolean bench_check_hostile(void);
+static gboolean bench_check_dither(void);
+static struct MaxResource *bench_open_archive(const gchar *filename, const struct MaxResourceItem *items, gint count);
+static gboolean bench_check_archive(void);
+static void bench_free_asset(gpointer data);
+
+/** Tokens are little endian gint16 values, positive for literals and negative for repeats. */
+static const struct MaxBenchPayload bench_payloads[] = {
+    {"single repeat", {0xF0, 0xFF, 0x07}, 3, TRUE},
+    {"literal and repeat", {0x08, 0x00, 1, 2, 3, 4, 5, 6, 7, 8, 0xF8, 0xFF, 0x09}, 13, TRUE},
+    {"zero length tokens", {0}, 12, FALSE},
+    {"repeat past image", {0xEF, 0xFF, 0x07}, 3, FALSE},
+    {"literal past image", {0x11, 0x00}, 19, FALSE},
+    {"literal past input", {0x10, 0x00, 1, 2, 3}, 5, FALSE},
+    {"repeat without value", {0xF0, 0xFF}, 2, FALSE},
+    {"minimum token", {0x00, 0x80, 0x07}, 3, FALSE},
+    {"image not filled", {0xF1, 0xFF, 0x07}, 3, FALSE},
+};
+
+/**
+ * The Big RLE decoder of the first plug-in release, kept as the throughput baseline of the checked decoders. It does
+ * no bounds checks at all.
+ */
+gboolean bench_decode_baseline(const struct MaxHeader *header, guchar *pixels) {
+    const guchar *pointer = header->payload;
+    gint image_size = header->width * header->height;
+
+    while (image_size > 0) {
+        gint16 option_word = max_get_int16(pointer);
+
+        pointer += sizeof(gint16);
+
+        if (option_word > 0) {
+            memcpy(pixels, pointer, option_word);
+            pointer += option_word;
+        } else {
+            option_word = -option_word;
+            memset(pixels, pointer[0], option_word);
+            pointer += sizeof(guchar);
+        }
+
+        pixels += option_word;
+        image_size -= option_word;
+    }
+
+    return TRUE;
+}
+
+gboolean bench_decode_checked(const struct MaxHeader *header, guchar *pixels) {
+    struct MaxReader reader;
+
+    max_reader_init(&reader, header->payload, header->payload_size);
+
+    return image_rle_decode(&reader, header->payload_size, pixels, header->width, header->height);
+}
+
+gboolean bench_decode_stream(const struct MaxHeader *header, guchar *pixels) {
+    struct MaxRleDecoder decoder;
+    gint band_rows = MIN(header->height, MAX(1, MAX_BAND_SIZE / header->width));
+    gint row;
+
+    image_rle_decoder_init(&decoder, header->payload, header->payload_size);
+
+    /* bands of the same height as the plug-in loader uses */
+    for (row = 0; row < header->height; row += band_rows) {
+        gint rows = MIN(band_rows, header->height - row);
+
+        if (!image_rle_decoder_read(&decoder, &pixels[row * header->width], (gsize)rows * header->width)) {
+            return FALSE;
+        }
+    }
+
+    /* the last token must end with the image */
+    return decoder.remaining == 0;
+}
+
+/**
+ * Adds a file to the corpus if it is a Big image the checked decoder accepts. Takes ownership of data.
+ */
+gboolean bench_add_asset(GPtrArray *corpus, const gchar *filename, guchar *data, gsize size) {
+    struct MaxBenchAsset *asset;
+    struct MaxHeader header;
+    struct MaxImage *image;
+
+    image = sniff_max_format(data, size, size, &header) == MAX_FORMAT_BIG ? decode_max_big(data, size, NULL) : NULL;
+    if (!image) {
+        g_free(data);
+        return FALSE;
+    }
+
+    max_image_free(image);
+
+    asset = g_malloc0(sizeof(struct MaxBenchAsset));
+    asset->name = g_strdup(filename);
+    asset->data = data;
+    asset->size = size;
+    asset->header = header;
+
+    g_ptr_array_add(corpus, asset);
+
+    return TRUE;
+}
+
+void bench_load_path(GPtrArray *corpus, const gchar *path) {
+    gchar *data;
+    gsize size;
+
+    if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+        GDir *dir = g_dir_open(path, 0, NULL);
+        const gchar *name;
+
+        while (dir && (name = g_dir_read_name(dir))) {
+            gchar *child = g_build_filename(path, name, NULL);
+
+            bench_load_path(corpus, child);
+            g_free(child);
+        }
+
+        if (dir) {
+            g_dir_close(dir);
+        }
+
+    } else if (g_file_get_contents(path, &data, &size, NULL)) {
+        bench_add_asset(corpus, path, (guchar *)data, size);
+    }
+}
+
+/**
+ * Draws a unit like sprite: transparent background with flat, shaded and noisy texture blocks.
+ */
+struct MaxImage *bench_create_sprite(GRand *rand, gint width, gint height) {
+    struct MaxImage *image = g_malloc0(sizeof(struct MaxImage));
+    gint shapes = g_rand_int_range(rand, 4, 24);
+
+    image->width = width;
+    image->height = height;
+    image->pixels = g_malloc0(width * height);
+    image->palette = g_malloc(PALETTE_SIZE);
+
+    memcpy(image->palette, max_default_palette, PALETTE_SIZE);
+
+    while (shapes--) {
+        gint x0 = g_rand_int_range(rand, 0, width);
+        gint y0 = g_rand_int_range(rand, 0, height);
+        gint x1 = x0 + g_rand_int_range(rand, 1, width / 2 + 2);
+        gint y1 = y0 + g_rand_int_range(rand, 1, height / 2 + 2);
+        gint texture = g_rand_int_range(rand, 0, 3);
+        guchar color = g_rand_int_range(rand, 32, 240);
+        gint x;
+        gint y;
+
+        x1 = MIN(x1, width);
+        y1 = MIN(y1, height);
+
+        for (y = y0; y < y1; ++y) {
+            for (x = x0; x < x1; ++x) {
+                guchar *pixel = &image->pixels[y * width + x];
+
+                if (texture == 0) {
+                    *pixel = color;
+                } else if (texture == 1) {
+                    *pixel = color + (x / 3 + y) % 4;
+                } else {
+                    *pixel = color + g_rand_int_range(rand, 0, 16);
+                }
+            }
+        }
+    }
+
+    return image;
+}
+
+guchar *bench_encode(const struct MaxImage *image, gint rle_mode, gsize *size) {
+    struct MaxWriter writer;
+
+    max_writer_init(&writer, NULL);
+
+    if (!encode_max_big(&writer, image, rle_mode, NULL)) {
+        max_writer_free(&writer);
+        return NULL;
+    }
+
+    *size = max_writer_get_size(&writer);
+
+    return writer.data;
+}
+
+/**
+ * Fills the corpus with sprites of typical unit and building sizes, used when no asset directory is given.
+ */
+void bench_create_corpus(GPtrArray *corpus) {
+    const gint sizes[][2] = {{64, 64}, {128, 128}, {200, 150}, {640, 480}};
+    GRand *rand = g_rand_new_with_seed(BENCH_SYNTHETIC_SEED);
+    gint i;
+
+    for (i = 0; i < BENCH_SYNTHETIC_COUNT; ++i) {
+        const gint *size = sizes[i % G_N_ELEMENTS(sizes)];
+        struct MaxImage *image = bench_create_sprite(rand, size[0], size[1]);
+        gchar *name = g_strdup_printf("synthetic-%02i", i);
+        gsize data_size;
+        guchar *data = bench_encode(image, MAX_RLE_FAST, &data_size);
+
+        if (data) {
+            bench_add_asset(corpus, name, data, data_size);
+        }
+
+        g_free(name);
+        max_image_free(image);
+    }
+
+    g_rand_free(rand);
+}
+
+/**
+ * Decodes every asset of the corpus once and returns the elapsed time in microseconds, or -1 if an asset fails.
+ */
+gint64 bench_run(MaxBenchDecoder decoder, GPtrArray *corpus, guchar *pixels) {
+    gint64 start = g_get_monotonic_time();
+    guint i;
+
+    for (i = 0; i < corpus->len; ++i) {
+        const struct MaxBenchAsset *asset = g_ptr_array_index(corpus, i);
+
+        if (!decoder(&asset->header, pixels)) {
+            return -1;
+        }
+    }
+
+    return g_get_monotonic_time() - start;
+}
+
+gboolean bench_check_outputs(GPtrArray *corpus, guchar *pixels, guchar *reference) {
+    const MaxBenchDecoder decoders[] = {bench_decode_checked, bench_decode_stream};
+    guint i;
+    guint j;
+
+    for (i = 0; i < corpus->len; ++i) {
+        const struct MaxBenchAsset *asset = g_ptr_array_index(corpus, i);
+        gsize count = (gsize)asset->header.width * asset->header.height;
+
+        bench_decode_baseline(&asset->header, reference);
+
+        for (j = 0; j < G_N_ELEMENTS(decoders); ++j) {
+            if (!decoders[j](&asset->header, pixels) || memcmp(pixels, reference, count)) {
+                g_printerr("max-bench: %s: Decoders disagree.\n", asset->name);
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Encodes the corpus with every RLE mode once and reports the output size against the time spent. Every encoding is
+ * decoded again and compared with the source pixels.
+ */
+gboolean bench_report_encoders(GPtrArray *corpus, guchar *pixels, gsize pixel_count) {
+    const gint modes[] = {MAX_RLE_FAST, MAX_RLE_SMALLEST, MAX_RLE_FAST | MAX_RLE_CROSS_ROW,
+                          MAX_RLE_SMALLEST | MAX_RLE_CROSS_ROW};
+    const gchar *names[] = {"fast", "smallest", "fast-rows", "smallest-rows"};
+    gsize sizes[G_N_ELEMENTS(modes)] = {0};
+    guint i;
+    guint j;
+
+    for (i = 0; i < G_N_ELEMENTS(modes); ++i) {
+        gint64 elapsed = 0;
+
+        for (j = 0; j < corpus->len; ++j) {
+            const struct MaxBenchAsset *asset = g_ptr_array_index(corpus, j);
+            struct MaxImage *image = decode_max_big(asset->data, asset->size, NULL);
+            struct MaxHeader header;
+            gint64 start = g_get_monotonic_time();
+            guchar *data;
+            gsize size;
+
+            data = bench_encode(image, modes[i], &size);
+            elapsed += g_get_monotonic_time() - start;
+
+            if (!data || !read_max_big_header(data, size, &header, NULL) || !bench_decode_checked(&header, pixels) ||
+                memcmp(pixels, image->pixels, (gsize)image->width * image->height)) {
+                g_printerr("max-bench: %s: The %s encoding does not decode to the source.\n", asset->name, names[i]);
+                g_free(data);
+                max_image_free(image);
+                return FALSE;
+            }
+
+            sizes[i] += header.payload_size;
+            g_free(data);
+            max_image_free(image);
+        }
+
+        g_print("%-14s %10" G_GSIZE_FORMAT " bytes %6.1f%% %8.1f MB/s\n", names[i], sizes[i],
+                100.0 * sizes[i] / MAX(sizes[0], 1), (gdouble)pixel_count / MAX(elapsed, 1));
+    }
+
+    /* the row bound optimizer may never lose against the greedy encoder */
+    if (sizes[1] > sizes[0]) {
+        g_printerr("max-bench: The smallest encoding is larger than the fast one.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Runs a Big file through every checked decoder and compares the outcome with the expected one.
+ */
+gboolean bench_expect(const gchar *name, const guchar *data, gsize size, gboolean valid) {
+    struct MaxHeader header;
+    struct MaxImage *image;
+    gboolean result;
+
+    image = decode_max_big(data, size, NULL);
+    result = (image != NULL) == valid;
+    max_image_free(image);
+
+    if (result && read_max_big_header(data, size, &header, NULL) &&
+        (gsize)header.width * header.height <= BENCH_STREAM_LIMIT) {
+        guchar *pixels = g_malloc((gsize)header.width * header.height);
+
+        result = bench_decode_stream(&header, pixels) == valid;
+        g_free(pixels);
+    }
+
+    if (!result) {
+        g_printerr("max-bench: %s: %s.\n", name, valid ? "Valid input rejected" : "Hostile input accepted");
+    }
+
+    return result;
+}
+
+/**
+ * Feeds the decoders with truncated files, malformed tokens and dimensions the payload cannot cover.
+ */
+gboolean bench_check_hostile(void) {
+    struct MaxImage image = {0};
+    gboolean result = TRUE;
+    GRand *rand = g_rand_new_with_seed(BENCH_SYNTHETIC_SEED);
+    struct MaxImage *sprite = bench_create_sprite(rand, 48, 32);
+    guchar *data;
+    gsize size;
+    gsize i;
+
+    g_rand_free(rand);
+
+    data = bench_encode(sprite, MAX_RLE_FAST, &size);
+    max_image_free(sprite);
+
+    for (i = 0; data && i < size; ++i) {
+        result &= bench_expect("truncated file", data, i, FALSE);
+    }
+
+    g_free(data);
+
+    for (i = 0; i < G_N_ELEMENTS(bench_payloads); ++i) {
+        const struct MaxBenchPayload *payload = &bench_payloads[i];
+        struct MaxWriter writer;
+
+        image.width = BENCH_HOSTILE_SIZE;
+        image.height = BENCH_HOSTILE_SIZE;
+        image.palette = (guchar *)max_default_palette;
+
+        max_writer_init(&writer, NULL);
+        encode_max_big_header(&writer, &image, NULL);
+        max_writer_append(&writer, payload->data, payload->size);
+
+        result &= bench_expect(payload->name, writer.data, writer.length, payload->valid);
+        max_writer_free(&writer);
+    }
+
+    {
+        struct MaxWriter writer;
+        const guchar token[] = {0x01, 0x80, 0x07};
+
+        image.width = G_MAXINT16;
+        image.height = G_MAXINT16;
+
+        max_writer_init(&writer, NULL);
+        encode_max_big_header(&writer, &image, NULL);
+        max_writer_append(&writer, token, sizeof(token));
+
+        result &= bench_expect("huge dimensions", writer.data, writer.length, FALSE);
+        max_writer_free(&writer);
+    }
+
+    return result;
+}
+
+/**
+ * Dithers the same RGB image with one and with several threads, the palette indices must not depend on the split.
+ */
+gboolean bench_check_dither(void) {
+    const gint modes[] = {MAX_DITHER_ORDERED, MAX_DITHER_FLOYD_STEINBERG};
+    const gchar *names[] = {"ordered", "Floyd-Steinberg"};
+    const gsize count = (gsize)BENCH_DITHER_WIDTH * BENCH_DITHER_HEIGHT;
+    gint threads = MAX(BENCH_DITHER_THREADS, (gint)g_get_num_processors());
+    GRand *rand = g_rand_new_with_seed(BENCH_SYNTHETIC_SEED);
+    struct MaxPaletteMap *map = max_palette_map_new(max_default_palette, 0, FALSE);
+    guchar *pixels = g_malloc(3 * count);
+    guchar *reference = g_malloc(count);
+    guchar *indices = g_malloc(count);
+    gboolean result = TRUE;
+    gsize i;
+
+    /* gradients with noise, so that both error diffusion and the threshold matrix change the result */
+    for (i = 0; i < count; ++i) {
+        gint x = i % BENCH_DITHER_WIDTH;
+        gint y = i / BENCH_DITHER_WIDTH;
+
+        pixels[3 * i] = x * 255 / BENCH_DITHER_WIDTH;
+        pixels[3 * i + 1] = y * 255 / BENCH_DITHER_HEIGHT;
+        pixels[3 * i + 2] = g_rand_int_range(rand, 0, 256);
+    }
+
+    g_rand_free(rand);
+
+    for (i = 0; i < G_N_ELEMENTS(modes); ++i) {
+        struct MaxDither *dither = max_dither_new(map, modes[i], BENCH_DITHER_WIDTH, 1);
+
+        max_dither_apply(dither, pixels, 3, reference, 0, BENCH_DITHER_HEIGHT);
+        max_dither_free(dither);
+
+        dither = max_dither_new(map, modes[i], BENCH_DITHER_WIDTH, threads);
+        max_dither_apply(dither, pixels, 3, indices, 0, BENCH_DITHER_HEIGHT);
+        max_dither_free(dither);
+
+        if (memcmp(reference, indices, count)) {
+            g_printerr("max-bench: %s dithering with %i threads differs from one thread.\n", names[i], threads);
+            result = FALSE;
+        }
+    }
+
+    g_free(pixels);
+    g_free(reference);
+    g_free(indices);
+    max_palette_map_free(map);
+
+    return result;
+}
+
+/**
+ * Opens the archive and checks that every item reads back byte equal.
+ */
+struct MaxResource *bench_open_archive(const gchar *filename, const struct MaxResourceItem *items, gint count) {
+    struct MaxResource *resource;
+    GError *error = NULL;
+
+    resource = max_resource_open(filename, &error);
+    if (!resource) {
+        g_printerr("max-bench: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    for (gint i = 0; i < count; ++i) {
+        const guchar *data;
+        gsize size;
+
+        data = max_resource_get_data(resource, items[i].name, &size, &error);
+        if (!data) {
+            g_printerr("max-bench: %s\n", error->message);
+            g_error_free(error);
+            max_resource_close(resource);
+            return NULL;
+        }
+
+        if (size != items[i].size || memcmp(data, items[i].data, size)) {
+            g_printerr("max-bench: The archive entry %s does not read back.\n", items[i].name);
+            max_resource_close(resource);
+            return NULL;
+        }
+    }
+
+    return resource;
+}
+
+/**
+ * Writes three items of which two are identical, then replaces one of them with update set. The identical items must
+ * share their data and the update must only append the new content and the directory.
+ */
+gboolean bench_check_archive(void) {
+    const gsize sizes[] = {300, 500, 200};
+    GRand *rand = g_rand_new_with_seed(BENCH_SYNTHETIC_SEED);
+    guchar *blocks[G_N_ELEMENTS(sizes)];
+    struct MaxResourceItem items[] = {{"FIRST"}, {"SECOND"}, {"THIRD"}};
+    struct MaxResource *resource;
+    GError *error = NULL;
+    gchar *filename = NULL;
+    gsize old_size = 0;
+    gboolean result = FALSE;
+    gint fd;
+
+    for (guint i = 0; i < G_N_ELEMENTS(sizes); ++i) {
+        blocks[i] = g_malloc(sizes[i]);
+
+        for (gsize j = 0; j < sizes[i]; ++j) {
+            blocks[i][j] = g_rand_int_range(rand, 0, 256);
+        }
+    }
+
+    g_rand_free(rand);
+
+    /* the first two items are identical */
+    for (guint i = 0; i < G_N_ELEMENTS(items); ++i) {
+        items[i].data = blocks[MAX(i, 1) - 1];
+        items[i].size = sizes[MAX(i, 1) - 1];
+    }
+
+    fd = g_file_open_tmp(BENCH_ARCHIVE_TEMPLATE, &filename, &error);
+    if (fd < 0 || !g_close(fd, &error) || !max_resource_write(filename, items, G_N_ELEMENTS(items), FALSE, &error)) {
+        g_printerr("max-bench: %s\n", error->message);
+        g_error_free(error);
+
+    } else if ((resource = bench_open_archive(filename, items, G_N_ELEMENTS(items)))) {
+        if (max_resource_find(resource, "FIRST")->offset != max_resource_find(resource, "SECOND")->offset) {
+            g_printerr("max-bench: Identical archive entries are stored twice.\n");
+        } else {
+            old_size = resource->size;
+        }
+
+        max_resource_close(resource);
+    }
+
+    if (old_size) {
+        items[2].data = blocks[2];
+        items[2].size = sizes[2];
+
+        if (!max_resource_write(filename, items, G_N_ELEMENTS(items), TRUE, &error)) {
+            g_printerr("max-bench: %s\n", error->message);
+            g_error_free(error);
+
+        } else if ((resource = bench_open_archive(filename, items, G_N_ELEMENTS(items)))) {
+            result = resource->size == old_size + sizes[2] + G_N_ELEMENTS(items) * MAX_RESOURCE_ENTRY_SIZE;
+
+            if (!result) {
+                g_printerr("max-bench: Updating one archive entry grew the archive by %" G_GSIZE_FORMAT " bytes.\n",
+                           resource->size - old_size);
+            }
+
+            max_resource_close(resource);
+        }
+    }
+
+    if (filename) {
+        g_unlink(filename);
+        g_free(filename);
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS(sizes); ++i) {
+        g_free(blocks[i]);
+    }
+
+    return result;
+}
+
+void bench_free_asset(gpointer data) {
+    struct MaxBenchAsset *asset = data;
+
+    g_free(asset->name);
+    g_free(asset->data);
+    g_free(asset);
+}
+
+int main(int argc, char **argv) {
+    const MaxBenchDecoder decoders[] = {bench_decode_baseline, bench_decode_checked, bench_decode_stream};
+    const gchar *names[] = {"baseline", "checked", "streaming"};
+    gint64 times[G_N_ELEMENTS(decoders)] = {0};
+    gdouble min_ratio = 0.0;
+    gdouble seconds = 1.0;
+    gboolean check_only = FALSE;
+    gchar **inputs = NULL;
+    GOptionContext *context;
+    GError *error = NULL;
+    GPtrArray *corpus;
+    gsize pixel_count = 0;
+    gsize max_count = 0;
+    guchar *pixels;
+    guchar *reference;
+    gboolean result;
+    gint rounds;
+    guint i;
+
+    GOptionEntry entries[] = {
+        {"time", 't', 0, G_OPTION_ARG_DOUBLE, &seconds, "Minimum run time of every decoder in seconds", "SECONDS"},
+        {"min-ratio", 'm', 0, G_OPTION_ARG_DOUBLE, &min_ratio,
+         "Fail if a checked decoder is slower than RATIO times the baseline", "RATIO"},
+        {"check-only", 'c', 0, G_OPTION_ARG_NONE, &check_only, "Only run the correctness checks, skip the timing",
+         NULL},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL, "[FILE|DIR...]"},
+        {NULL},
+    };
+
+    context = g_option_context_new("- benchmark the M.A.X. Big codecs");
+    g_option_context_set_summary(context,
+                                 "Decodes the Big files found in the given paths, or a synthetic sprite corpus, with "
+                                 "the baseline and the checked decoders and checks them against hostile input. Then "
+                                 "reports size and speed of every RLE encoder mode on the same files.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    result = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+
+    if (!result) {
+        g_printerr("max-bench: %s\n", error->message);
+        g_error_free(error);
+        g_strfreev(inputs);
+        return EXIT_FAILURE;
+    }
+
+    result = bench_check_hostile();
+    g_print("hostile input: %s\n", result ? "rejected" : "FAILED");
+
+    if (bench_check_dither()) {
+        g_print("dithering: independent of threads\n");
+    } else {
+        result = FALSE;
+    }
+
+    if (bench_check_archive()) {
+        g_print("archive: shared and appended\n");
+    } else {
+        result = FALSE;
+    }
+
+    corpus = g_ptr_array_new_with_free_func(bench_free_asset);
+
+    for (i = 0; inputs && inputs[i]; ++i) {
+        bench_load_path(corpus, inputs[i]);
+    }
+
+    g_strfreev(inputs);
+
+    if (!corpus->len) {
+        bench_create_corpus(corpus);
+    }
+
+    for (i = 0; i < corpus->len; ++i) {
+        const struct MaxBenchAsset *asset = g_ptr_array_index(corpus, i);
+        gsize count = (gsize)asset->header.width * asset->header.height;
+
+        pixel_count += count;
+        max_count = MAX(max_count, count);
+    }
+
+    pixels = g_malloc(max_count);
+    reference = g_malloc(max_count);
+
+    result &= bench_check_outputs(corpus, pixels, reference);
+
+    /* decoders take turns so that clock and cache effects hit all of them alike */
+    for (rounds = 0; result && !check_only && (rounds < 3 || times[0] < seconds * G_USEC_PER_SEC); ++rounds) {
+        for (i = 0; i < G_N_ELEMENTS(decoders); ++i) {
+            gint64 elapsed = bench_run(decoders[i], corpus, pixels);
+
+            if (elapsed < 0) {
+                result = FALSE;
+                break;
+            }
+
+            times[i] += elapsed;
+        }
+    }
+
+    g_print("corpus: %u Big files, %" G_GSIZE_FORMAT " pixels, %i rounds\n", corpus->len, pixel_count, rounds);
+
+    for (i = 0; result && !check_only && i < G_N_ELEMENTS(decoders); ++i) {
+        gdouble throughput = (gdouble)pixel_count * rounds / MAX(times[i], 1);
+        gdouble ratio = (gdouble)MAX(times[0], 1) / MAX(times[i], 1);
+
+        g_print("%-10s %10.1f MB/s %6.2fx\n", names[i], throughput, ratio);
+
+        if (ratio < min_ratio) {
+            g_printerr("max-bench: The %s decoder is slower than %.2f times the baseline.\n", names[i], min_ratio);
+            result = FALSE;
+        }
+    }
+
+    if (result) {
+        result = bench_report_encoders(corpus, pixels, pixel_count);
+    }
+
+    g_free(pixels);
+    g_free(reference);
+    g_ptr_array_free(corpus, TRUE);
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
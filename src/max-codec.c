@@ -0,0 +1,1798 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "max-codec.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "max-simd.h"
+#include "palette.h"
+
+/** Work item of the Multi frame decoder pool. Every task decodes one frame from the shared file data. */
+struct MaxMultiTask {
+    const guchar *data;
+    gsize size;
+    guint32 offset;
+    gint format;
+    struct MaxMultiImage *image;
+};
+
+/** Work item of the Multi frame encoder pool. Every task encodes one frame into its own buffer, row offsets are
+ * relative to the start of the frame until the file is assembled.
+ */
+struct MaxMultiEncodeTask {
+    const struct MaxMultiImage *image;
+    gint format;
+    struct MaxWriter writer;
+    gboolean result;
+};
+
+static gboolean image_rle_encode_emit(struct MaxWriter *writer, const guchar *buffer, gint size, gboolean repeat_mode);
+static gboolean image_rle_encode_rows(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride,
+                                      gsize size);
+static gboolean decode_max_multi_image(struct MaxReader *reader, struct MaxMultiImage *image);
+static gboolean decode_max_multi_shadow(struct MaxReader *reader, struct MaxMultiImage *image);
+static gint classify_max_multi_image(const struct MaxReader *reader, const struct MaxMultiImage *image);
+static struct MaxMultiImage *read_max_multi_image(struct MaxReader *reader, guint32 address, gint *format);
+static void decode_max_multi_task(gpointer data, gpointer user_data);
+static gboolean read_max_multi_canvas(struct MaxReader *reader, gint *ulx, gint *uly, gint *width, gint *height);
+static gboolean decode_max_preview_rows(const struct MaxHeader *header, const gint *row_map, guchar *rows);
+static void max_preview_shrink(struct MaxImage *preview, const guchar *rows, gint row_width, const guchar *palette);
+static gboolean encode_max_multi_image(struct MaxWriter *writer, const struct MaxMultiImage *image, gint format);
+static void encode_max_multi_task(gpointer data, gpointer user_data);
+static gboolean encode_max_frames(struct MaxWriter *writer, const struct MaxMulti *multi, gint format,
+                                  GError **error);
+static void max_multi_image_free(struct MaxMultiImage *image);
+
+const guchar max_default_palette[PALETTE_SIZE] = {PALETTE_INIT};
+
+void max_reader_init(struct MaxReader *reader, const guchar *data, gsize size) {
+    reader->data = data;
+    reader->size = size;
+    reader->position = 0;
+}
+
+gboolean max_reader_read(struct MaxReader *reader, gpointer buffer, gsize size) {
+    if (reader->position > reader->size || size > reader->size - reader->position) {
+        return FALSE;
+    }
+
+    memcpy(buffer, &reader->data[reader->position], size);
+    reader->position += size;
+
+    return TRUE;
+}
+
+const guchar *max_reader_peek(struct MaxReader *reader, gsize size) {
+    const guchar *pointer;
+
+    if (reader->position > reader->size || size > reader->size - reader->position) {
+        return NULL;
+    }
+
+    pointer = &reader->data[reader->position];
+    reader->position += size;
+
+    return pointer;
+}
+
+gboolean max_reader_seek(struct MaxReader *reader, gsize position) {
+    if (position > reader->size) {
+        return FALSE;
+    }
+
+    reader->position = position;
+
+    return TRUE;
+}
+
+gsize max_reader_tell(struct MaxReader *reader) { return reader->position; }
+
+void max_writer_init(struct MaxWriter *writer, FILE *fd) {
+    memset(writer, 0, sizeof(struct MaxWriter));
+    writer->fd = fd;
+}
+
+/**
+ * Returns a pointer to size bytes at the end of the buffer that the caller has to fill in. A full buffer is written
+ * to the attached file first.
+ */
+guchar *max_writer_reserve(struct MaxWriter *writer, gsize size) {
+    guchar *pointer;
+
+    if (writer->failed) {
+        return NULL;
+    }
+
+    if (writer->fd && writer->length && writer->length + size > MAX_WRITER_CHUNK_SIZE) {
+        if (!max_writer_flush(writer, writer->fd)) {
+            return NULL;
+        }
+    }
+
+    if (writer->length + size > writer->capacity) {
+        gsize capacity = MAX(writer->capacity * 2, MAX_WRITER_CHUNK_SIZE);
+
+        while (capacity < writer->length + size) {
+            capacity *= 2;
+        }
+
+        writer->data = g_realloc(writer->data, capacity);
+        writer->capacity = capacity;
+    }
+
+    pointer = &writer->data[writer->length];
+    writer->length += size;
+
+    return pointer;
+}
+
+gboolean max_writer_append(struct MaxWriter *writer, gconstpointer data, gsize size) {
+    guchar *pointer = max_writer_reserve(writer, size);
+
+    if (!pointer) {
+        return FALSE;
+    }
+
+    memcpy(pointer, data, size);
+
+    return TRUE;
+}
+
+/**
+ * Writes the buffered data to the given file in one call and empties the buffer.
+ */
+gboolean max_writer_flush(struct MaxWriter *writer, FILE *fd) {
+    if (writer->failed) {
+        return FALSE;
+    }
+
+    if (writer->length && writer->length != fwrite(writer->data, sizeof(guchar), writer->length, fd)) {
+        writer->failed = TRUE;
+        return FALSE;
+    }
+
+    writer->flushed += writer->length;
+    writer->length = 0;
+
+    return TRUE;
+}
+
+/**
+ * Total number of bytes encoded so far, including the ones already written out.
+ */
+gsize max_writer_get_size(const struct MaxWriter *writer) { return writer->flushed + writer->length; }
+
+void max_writer_free(struct MaxWriter *writer) {
+    g_free(writer->data);
+    writer->data = NULL;
+    writer->length = 0;
+    writer->capacity = 0;
+}
+
+/**
+ * Decodes data_size bytes of RLE tokens into width * height pixels. Tokens that overrun the input or the image are
+ * rejected.
+ */
+gboolean image_rle_decode(struct MaxReader *reader, gint data_size, guchar *pixels, gint width, gint height) {
+    const guchar *pointer;
+    const guchar *end;
+    guchar *pixels_end;
+
+    if (data_size < 0 || width < 0 || height < 0 || reader->position > reader->size ||
+        data_size > reader->size - reader->position) {
+        return FALSE;
+    }
+
+    pointer = &reader->data[reader->position];
+    end = pointer + data_size;
+    pixels_end = pixels + (gsize)width * height;
+    reader->position += data_size;
+
+    while (pixels < pixels_end) {
+        gint option_word;
+
+        if (end - pointer < (gssize)sizeof(gint16)) {
+            return FALSE;
+        }
+
+        option_word = max_get_int16(pointer);
+        pointer += sizeof(gint16);
+
+        if (option_word > 0) {
+            if (option_word > end - pointer || option_word > pixels_end - pixels) {
+                return FALSE;
+            }
+
+            memcpy(pixels, pointer, option_word);
+
+            pointer += option_word;
+        } else {
+            option_word = -option_word;
+
+            if (pointer == end || option_word > pixels_end - pixels) {
+                return FALSE;
+            }
+
+            memset(pixels, pointer[0], option_word);
+
+            pointer += sizeof(guchar);
+        }
+
+        pixels += option_word;
+    }
+
+    return TRUE;
+}
+
+void image_rle_decoder_init(struct MaxRleDecoder *decoder, const guchar *data, gsize size) {
+    decoder->pointer = data;
+    decoder->end = data + size;
+    decoder->remaining = 0;
+    decoder->repeat_mode = FALSE;
+    decoder->value = 0;
+}
+
+/**
+ * Decodes the next size pixels. A token that does not fit is continued by the next call, tokens that overrun the input
+ * are rejected.
+ */
+gboolean image_rle_decoder_read(struct MaxRleDecoder *decoder, guchar *pixels, gsize size) {
+    const guchar *pointer = decoder->pointer;
+    const guchar *end = decoder->end;
+    gsize count;
+
+    if (decoder->remaining) {
+        count = MIN(size, (gsize)decoder->remaining);
+
+        if (decoder->repeat_mode) {
+            memset(pixels, decoder->value, count);
+        } else {
+            memcpy(pixels, pointer, count);
+            pointer += count;
+        }
+
+        pixels += count;
+        size -= count;
+        decoder->remaining -= count;
+    }
+
+    /* whole tokens are copied straight away, only a token that does not fit is left for the next call */
+    while (size) {
+        gint option_word;
+
+        if (end - pointer < (gssize)sizeof(gint16)) {
+            return FALSE;
+        }
+
+        option_word = max_get_int16(pointer);
+        pointer += sizeof(gint16);
+
+        if (option_word > 0) {
+            if (option_word > end - pointer) {
+                return FALSE;
+            }
+
+            count = option_word;
+
+            if (count > size) {
+                decoder->repeat_mode = FALSE;
+                decoder->remaining = count - size;
+                count = size;
+            }
+
+            memcpy(pixels, pointer, count);
+            pointer += count;
+        } else {
+            if (pointer == end) {
+                return FALSE;
+            }
+
+            count = -option_word;
+
+            if (count > size) {
+                decoder->repeat_mode = TRUE;
+                decoder->value = pointer[0];
+                decoder->remaining = count - size;
+                count = size;
+            }
+
+            memset(pixels, pointer[0], count);
+            pointer += sizeof(guchar);
+        }
+
+        pixels += count;
+        size -= count;
+    }
+
+    decoder->pointer = pointer;
+
+    return TRUE;
+}
+
+gboolean image_rle_encode_emit(struct MaxWriter *writer, const guchar *buffer, gint size, gboolean repeat_mode) {
+    if (repeat_mode) {
+        gint16 option_word = -G_MAXINT16;
+
+        while (size) {
+            guchar *pointer;
+
+            if (size >= G_MAXINT16) {
+                size -= G_MAXINT16;
+            } else {
+                option_word = -size;
+                size = 0;
+            }
+
+            pointer = max_writer_reserve(writer, sizeof(option_word) + sizeof(guchar));
+            if (!pointer) {
+                return FALSE;
+            }
+
+            max_put_int16(pointer, option_word);
+            pointer[sizeof(option_word)] = buffer[0];
+        }
+    } else {
+        gint16 option_word = G_MAXINT16;
+        gint offset = 0;
+
+        while (size) {
+            guchar *pointer;
+
+            if (size >= G_MAXINT16) {
+                size -= G_MAXINT16;
+            } else {
+                option_word = size;
+                size = 0;
+            }
+
+            pointer = max_writer_reserve(writer, sizeof(option_word) + option_word);
+            if (!pointer) {
+                return FALSE;
+            }
+
+            max_put_int16(pointer, option_word);
+            memcpy(&pointer[sizeof(option_word)], &buffer[offset], option_word);
+
+            offset += option_word;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Greedy encoder. Each row is split into literal tokens and repeat tokens of at least RLE_BREAK_EVEN equal bytes.
+ * Runs are located with the vectorized scanners, the pattern check may look ahead into the next row.
+ */
+gboolean image_rle_encode(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride) {
+    return image_rle_encode_rows(writer, buffer, rows, rowstride, (gsize)rows * rowstride);
+}
+
+/**
+ * Greedy encoder of the given rows. The pattern check may read up to size bytes, which lets bands of a larger image
+ * produce the same tokens as the whole image if the next row follows the band.
+ */
+gboolean image_rle_encode_rows(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride, gsize size) {
+    if (!writer) {
+        return FALSE;
+    }
+
+    for (gint i = 0; i < rows; ++i) {
+        gsize row_start = (gsize)i * rowstride;
+        gsize row_end = row_start + rowstride;
+        gsize start_position = row_start;
+
+        for (;;) {
+            gsize pattern_position = row_end - 1;
+            gsize end_position;
+
+            if (rowstride > RLE_BREAK_EVEN) {
+                pattern_position = max_find_pattern(buffer, start_position, row_end - 1, size);
+            }
+
+            if (pattern_position == row_end - 1) {
+                if (!image_rle_encode_emit(writer, &buffer[start_position], row_end - start_position, FALSE)) {
+                    return FALSE;
+                }
+
+                break;
+            }
+
+            if (!image_rle_encode_emit(writer, &buffer[start_position], pattern_position - start_position, FALSE)) {
+                return FALSE;
+            }
+
+            end_position = max_find_mismatch(buffer, pattern_position + 2, row_end, buffer[pattern_position]);
+
+            if (!image_rle_encode_emit(writer, &buffer[pattern_position], end_position - pattern_position, TRUE)) {
+                return FALSE;
+            }
+
+            if (end_position == row_end) {
+                break;
+            }
+
+            start_position = end_position;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Classifies a file from its first bytes and its total size in a single pass. The data may be a prefix of the file
+ * of at least MAX_SNIFF_SIZE bytes, in which case only the header fields are filled in. The palette and payload
+ * pointers are only set when the whole file is passed in.
+ *
+ * Returns the detected format or -1 if the data is not recognized.
+ */
+gint sniff_max_format(const guchar *data, gsize size, gsize file_size, struct MaxHeader *header) {
+    gboolean complete = (size == file_size);
+
+    memset(header, 0, sizeof(struct MaxHeader));
+    header->format = -1;
+
+    if (size < 4 * sizeof(gint16) || size > file_size) {
+        return header->format;
+    }
+
+    header->width = max_get_int16(&data[0]);
+    header->height = max_get_int16(&data[2]);
+
+    if (header->width > 0 && header->height > 0 &&
+        header->width * header->height + 4 * sizeof(gint16) == file_size) {
+        header->format = MAX_FORMAT_SIMPLE;
+        header->hotx = max_get_int16(&data[4]);
+        header->hoty = max_get_int16(&data[6]);
+        header->payload_size = header->width * header->height;
+
+        if (complete) {
+            header->payload = &data[4 * sizeof(gint16)];
+        }
+
+        return header->format;
+    }
+
+    header->hotx = max_get_int16(&data[0]);
+    header->hoty = max_get_int16(&data[2]);
+    header->width = max_get_int16(&data[4]);
+    header->height = max_get_int16(&data[6]);
+
+    if (header->hotx == 0 && header->hoty == 0 && header->width > 0 && header->height > 0 &&
+        file_size > 4 * sizeof(gint16) + PALETTE_SIZE) {
+        header->format = MAX_FORMAT_BIG;
+        header->payload_size = file_size - 4 * sizeof(gint16) - PALETTE_SIZE;
+
+        if (complete) {
+            header->palette = &data[4 * sizeof(gint16)];
+            header->payload = &data[4 * sizeof(gint16) + PALETTE_SIZE];
+        }
+
+        return header->format;
+    }
+
+    memset(header, 0, sizeof(struct MaxHeader));
+    header->format = -1;
+
+    header->image_count = max_get_int16(&data[0]);
+
+    if (header->image_count > 0 &&
+        max_get_int32(&data[2]) == sizeof(gint16) + header->image_count * sizeof(guint32) &&
+        max_get_int32(&data[2]) < file_size) {
+        header->format = MAX_FORMAT_MULTI;
+        header->payload_size = file_size;
+
+        if (complete) {
+            header->payload = data;
+        }
+
+        return header->format;
+    }
+
+    header->image_count = 0;
+
+    return header->format;
+}
+
+/**
+ * Cheap stand alone variant of sniff_max_format() that only reads the first MAX_SNIFF_SIZE bytes of a file. The
+ * header carries no palette or payload pointers, even for files small enough to be read completely.
+ */
+gint probe_max_file(const gchar *filename, struct MaxHeader *header, GError **error) {
+    guchar data[MAX_SNIFF_SIZE];
+    GStatBuf stat_buffer;
+    gsize size;
+    FILE *fd;
+
+    memset(header, 0, sizeof(struct MaxHeader));
+    header->format = -1;
+
+    fd = g_fopen(filename, "rb");
+    if (!fd) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for reading: %s",
+                    filename, g_strerror(errno));
+        return -1;
+    }
+
+    if (0 != g_stat(filename, &stat_buffer)) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not stat '%s': %s", filename,
+                    g_strerror(errno));
+        fclose(fd);
+        return -1;
+    }
+
+    size = fread(data, sizeof(guchar), sizeof(data), fd);
+    fclose(fd);
+
+    sniff_max_format(data, size, stat_buffer.st_size, header);
+
+    /* the data pointers would refer to the local buffer */
+    header->palette = NULL;
+    header->payload = NULL;
+
+    return header->format;
+}
+
+gboolean read_max_simple_header(const guchar *data, gsize size, struct MaxHeader *header, GError **error) {
+    struct MaxReader reader;
+    const guchar *pointer;
+
+    max_reader_init(&reader, data, size);
+
+    pointer = max_reader_peek(&reader, 4 * sizeof(gint16));
+    if (!pointer) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        return FALSE;
+    }
+
+    header->format = MAX_FORMAT_SIMPLE;
+    header->image_count = 0;
+    header->width = max_get_int16(&pointer[0]);
+    header->height = max_get_int16(&pointer[2]);
+    header->hotx = max_get_int16(&pointer[4]);
+    header->hoty = max_get_int16(&pointer[6]);
+    header->palette = NULL;
+
+    if (header->width <= 0 || header->height <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        return FALSE;
+    }
+
+    header->payload_size = header->width * header->height;
+    header->payload = max_reader_peek(&reader, header->payload_size);
+
+    if (!header->payload) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean read_max_big_header(const guchar *data, gsize size, struct MaxHeader *header, GError **error) {
+    struct MaxReader reader;
+    const guchar *pointer;
+
+    max_reader_init(&reader, data, size);
+
+    pointer = max_reader_peek(&reader, 4 * sizeof(gint16));
+    if (!pointer) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        return FALSE;
+    }
+
+    header->format = MAX_FORMAT_BIG;
+    header->image_count = 0;
+    header->hotx = max_get_int16(&pointer[0]);
+    header->hoty = max_get_int16(&pointer[2]);
+    header->width = max_get_int16(&pointer[4]);
+    header->height = max_get_int16(&pointer[6]);
+
+    if (header->width <= 0 || header->height <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        return FALSE;
+    }
+
+    header->palette = max_reader_peek(&reader, PALETTE_SIZE);
+    if (!header->palette) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        return FALSE;
+    }
+
+    header->payload_size = size - max_reader_tell(&reader);
+    header->payload = max_reader_peek(&reader, header->payload_size);
+
+    return TRUE;
+}
+
+struct MaxImage *decode_max_simple(const guchar *data, gsize size, GError **error) {
+    struct MaxHeader header;
+    struct MaxImage *image;
+
+    if (!read_max_simple_header(data, size, &header, error)) {
+        return NULL;
+    }
+
+    image = g_malloc0(sizeof(struct MaxImage));
+    if (!image) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        return NULL;
+    }
+
+    image->width = header.width;
+    image->height = header.height;
+    image->hotx = header.hotx;
+    image->hoty = header.hoty;
+
+    image->pixels = g_malloc(header.payload_size);
+    if (!image->pixels) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        max_image_free(image);
+        return NULL;
+    }
+
+    memcpy(image->pixels, header.payload, header.payload_size);
+
+    return image;
+}
+
+struct MaxImage *decode_max_big(const guchar *data, gsize size, GError **error) {
+    struct MaxHeader header;
+    struct MaxReader reader;
+    struct MaxImage *image;
+
+    if (!read_max_big_header(data, size, &header, error)) {
+        return NULL;
+    }
+
+    /* a repeat token covers at most G_MAXINT16 pixels in three bytes, reject payloads too short before allocating */
+    if (header.payload_size / (sizeof(gint16) + sizeof(guchar)) <
+        ((gsize)header.width * header.height + G_MAXINT16 - 1) / G_MAXINT16) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
+        return NULL;
+    }
+
+    image = g_malloc0(sizeof(struct MaxImage));
+    if (!image) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        return NULL;
+    }
+
+    image->width = header.width;
+    image->height = header.height;
+    image->hotx = header.hotx;
+    image->hoty = header.hoty;
+
+    image->pixels = g_malloc(image->width * image->height);
+    image->palette = g_malloc(PALETTE_SIZE);
+
+    if (!image->pixels || !image->palette) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        max_image_free(image);
+        return NULL;
+    }
+
+    memcpy(image->palette, header.palette, PALETTE_SIZE);
+
+    max_reader_init(&reader, header.payload, header.payload_size);
+
+    if (!image_rle_decode(&reader, header.payload_size, image->pixels, image->width, image->height)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
+        max_image_free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+gboolean decode_max_multi_image(struct MaxReader *reader, struct MaxMultiImage *image) {
+    const guchar *pointer = &reader->data[reader->position];
+    const guchar *end = &reader->data[reader->size];
+    gsize image_size = (gsize)image->width * image->height;
+
+    for (gint i = 0; i < image->height; ++i) {
+        gsize offset = (gsize)i * image->width;
+
+        if (pointer - reader->data != image->rows[i]) {
+            return FALSE;
+        }
+
+        for (;;) {
+            guchar pixel_count;
+
+            if (pointer == end) {
+                return FALSE;
+            }
+
+            if (*pointer == 0xFF) {
+                ++pointer;
+                break;
+            }
+
+            if (end - pointer < 2) {
+                return FALSE;
+            }
+
+            offset += pointer[0];
+            pixel_count = pointer[1];
+            pointer += 2;
+
+            if (pixel_count > end - pointer || offset + pixel_count > image_size) {
+                return FALSE;
+            }
+
+            for (guchar *pixel = &image->pixels[MULTI_PIXEL_SIZE * offset]; pixel_count; --pixel_count) {
+                *pixel++ = *pointer++;
+                *pixel++ = 0xFF;
+                ++offset;
+            }
+        }
+    }
+
+    reader->position = pointer - reader->data;
+
+    return TRUE;
+}
+
+gboolean decode_max_multi_shadow(struct MaxReader *reader, struct MaxMultiImage *image) {
+    const guchar *pointer = &reader->data[reader->position];
+    const guchar *end = &reader->data[reader->size];
+    gsize image_size = (gsize)image->width * image->height;
+
+    for (gint i = 0; i < image->height; ++i) {
+        gsize offset = (gsize)i * image->width;
+
+        if (pointer - reader->data != image->rows[i]) {
+            return FALSE;
+        }
+
+        for (;;) {
+            guchar shadow_count;
+
+            if (pointer == end) {
+                return FALSE;
+            }
+
+            if (*pointer == 0xFF) {
+                ++pointer;
+                break;
+            }
+
+            if (end - pointer < 2) {
+                return FALSE;
+            }
+
+            offset += pointer[0];
+            shadow_count = pointer[1];
+            pointer += 2;
+
+            if (offset + shadow_count > image_size) {
+                return FALSE;
+            }
+
+            for (guchar *pixel = &image->pixels[MULTI_PIXEL_SIZE * offset]; shadow_count; --shadow_count) {
+                *pixel++ = 20;
+                *pixel++ = 0xFF;
+                ++offset;
+            }
+        }
+    }
+
+    reader->position = pointer - reader->data;
+
+    return TRUE;
+}
+
+/**
+ * Tells the two frame layouts apart without decoding. A frame is a shadow if all of its rows parse as pairs of
+ * transparent and shadow counts that end exactly where the row table says the next row starts. Frames without any
+ * pixels read the same in both layouts and leave the decision to the next frame.
+ */
+gint classify_max_multi_image(const struct MaxReader *reader, const struct MaxMultiImage *image) {
+    const guchar *pointer = &reader->data[reader->position];
+    const guchar *end = &reader->data[reader->size];
+    gsize image_size = (gsize)image->width * image->height;
+    gboolean empty = TRUE;
+
+    for (gint i = 0; i < image->height; ++i) {
+        gsize offset = (gsize)i * image->width;
+
+        if (pointer - reader->data != image->rows[i]) {
+            return MAX_FORMAT_MULTI;
+        }
+
+        for (;;) {
+            if (pointer == end) {
+                return MAX_FORMAT_MULTI;
+            }
+
+            if (*pointer == 0xFF) {
+                ++pointer;
+                break;
+            }
+
+            if (end - pointer < 2) {
+                return MAX_FORMAT_MULTI;
+            }
+
+            offset += pointer[0] + pointer[1];
+            empty = empty && !pointer[1];
+            pointer += 2;
+
+            if (offset > image_size) {
+                return MAX_FORMAT_MULTI;
+            }
+        }
+    }
+
+    return empty ? MAX_FORMAT_AUTO : MAX_FORMAT_SHADOW;
+}
+
+/**
+ * Reads the frame at the given address. The frame layout is classified on the first call and reused for the other
+ * frames of the file, so every frame is decoded exactly once.
+ */
+struct MaxMultiImage *read_max_multi_image(struct MaxReader *reader, guint32 address, gint *format) {
+    struct MaxMultiImage *image;
+    const guchar *pointer;
+
+    image = g_malloc0(sizeof(struct MaxMultiImage));
+    if (!image) {
+        return NULL;
+    }
+
+    image->file_offset = address;
+
+    if (!max_reader_seek(reader, image->file_offset)) {
+        max_multi_image_free(image);
+        return NULL;
+    }
+
+    pointer = max_reader_peek(reader, 4 * sizeof(gint16));
+    if (!pointer) {
+        max_multi_image_free(image);
+        return NULL;
+    }
+
+    image->width = max_get_int16(&pointer[0]);
+    image->height = max_get_int16(&pointer[2]);
+    image->hotx = max_get_int16(&pointer[4]);
+    image->hoty = max_get_int16(&pointer[6]);
+
+    if (image->width <= 0 || image->height <= 0) {
+        max_multi_image_free(image);
+        return NULL;
+    }
+
+    pointer = max_reader_peek(reader, image->height * sizeof(gint32));
+    image->rows = g_malloc(sizeof(gint32) * image->height);
+
+    if (!pointer || !image->rows) {
+        max_multi_image_free(image);
+        return NULL;
+    }
+
+    for (gint i = 0; i < image->height; ++i) {
+        image->rows[i] = max_get_int32(&pointer[i * sizeof(gint32)]);
+    }
+
+    image->pixels = g_malloc0(MULTI_PIXEL_SIZE * image->width * image->height);
+    if (!image->pixels) {
+        max_multi_image_free(image);
+        return NULL;
+    }
+
+    if (*format == MAX_FORMAT_AUTO) {
+        *format = classify_max_multi_image(reader, image);
+    }
+
+    if (*format != MAX_FORMAT_MULTI) {
+        if (!decode_max_multi_shadow(reader, image)) {
+            max_multi_image_free(image);
+            return NULL;
+        }
+    } else {
+        if (!decode_max_multi_image(reader, image)) {
+            max_multi_image_free(image);
+            return NULL;
+        }
+    }
+
+    return image;
+}
+
+struct MaxMulti *decode_max_multi(const guchar *data, gsize size, GError **error) {
+    struct MaxReader reader;
+    struct MaxMulti *multi;
+    struct MaxMultiTask *tasks;
+    const guchar *offsets;
+    gint first = 0;
+    gboolean result = TRUE;
+
+    max_reader_init(&reader, data, size);
+
+    multi = g_malloc0(sizeof(struct MaxMulti));
+    if (!multi) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        return NULL;
+    }
+
+    offsets = max_reader_peek(&reader, sizeof(multi->image_count));
+    if (!offsets) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    multi->image_count = max_get_int16(offsets);
+    if (multi->image_count <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    offsets = max_reader_peek(&reader, multi->image_count * sizeof(guint32));
+    if (!offsets) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File read error.");
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    multi->images = g_malloc0(multi->image_count * sizeof(struct MaxMultiImage *));
+    tasks = g_malloc0(multi->image_count * sizeof(struct MaxMultiTask));
+    if (!multi->images || !tasks) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        g_free(tasks);
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    for (gint i = 0; i < multi->image_count; ++i) {
+        tasks[i].data = data;
+        tasks[i].size = size;
+        tasks[i].offset = max_get_int32(&offsets[i * sizeof(guint32)]);
+        tasks[i].format = MAX_FORMAT_AUTO;
+    }
+
+    /* frames are decoded in order until one decides whether the file holds shadows, the rest are independent */
+    do {
+        decode_max_multi_task(&tasks[first], NULL);
+    } while (tasks[first].image && tasks[first].format == MAX_FORMAT_AUTO && ++first < multi->image_count);
+
+    if (first < multi->image_count - 1 && tasks[first].image) {
+        GThreadPool *pool;
+
+        for (gint i = first + 1; i < multi->image_count; ++i) {
+            tasks[i].format = tasks[first].format;
+        }
+
+        pool = g_thread_pool_new(decode_max_multi_task, NULL,
+                                 MIN(g_get_num_processors(), multi->image_count - first - 1), FALSE, NULL);
+
+        for (gint i = first + 1; i < multi->image_count; ++i) {
+            if (!pool || !g_thread_pool_push(pool, &tasks[i], NULL)) {
+                decode_max_multi_task(&tasks[i], NULL);
+            }
+        }
+
+        if (pool) {
+            g_thread_pool_free(pool, FALSE, TRUE);
+        }
+    }
+
+    for (gint i = 0; i < multi->image_count; ++i) {
+        multi->images[i] = tasks[i].image;
+
+        if (!multi->images[i]) {
+            result = FALSE;
+        }
+    }
+
+    g_free(tasks);
+
+    if (!result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        max_multi_free(multi);
+        return NULL;
+    }
+
+    return multi;
+}
+
+/**
+ * Decodes a whole file of any format. Simple and Big files are returned in image, Multi and Shadow files in multi, the
+ * other one is set to NULL. Returns the format of the file or -1 on failure.
+ */
+gint decode_max_data(const guchar *data, gsize size, struct MaxImage **image, struct MaxMulti **multi,
+                     GError **error) {
+    struct MaxHeader header;
+    gint format = sniff_max_format(data, size, size, &header);
+
+    *image = NULL;
+    *multi = NULL;
+
+    switch (format) {
+        case MAX_FORMAT_SIMPLE: {
+            *image = decode_max_simple(data, size, error);
+        } break;
+        case MAX_FORMAT_BIG: {
+            *image = decode_max_big(data, size, error);
+        } break;
+        case MAX_FORMAT_MULTI: {
+            *multi = decode_max_multi(data, size, error);
+        } break;
+        default: {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format not recognized.");
+        } break;
+    }
+
+    return *image || *multi ? format : -1;
+}
+
+void decode_max_multi_task(gpointer data, gpointer user_data) {
+    struct MaxMultiTask *task = data;
+    struct MaxReader reader;
+
+    max_reader_init(&reader, task->data, task->size);
+
+    task->image = read_max_multi_image(&reader, task->offset, &task->format);
+}
+
+/**
+ * Finds the canvas that holds every frame of a Multi file aligned at the hotspots, as the loader lays out the layers.
+ * Only the frame headers are read, ulx and uly receive the hotspot position on the canvas.
+ */
+gboolean read_max_multi_canvas(struct MaxReader *reader, gint *ulx, gint *uly, gint *width, gint *height) {
+    const guchar *offsets;
+    gint image_count;
+    gint lrx = 0;
+    gint lry = 0;
+
+    *ulx = 0;
+    *uly = 0;
+
+    if (!max_reader_seek(reader, 0) || !(offsets = max_reader_peek(reader, sizeof(gint16)))) {
+        return FALSE;
+    }
+
+    image_count = max_get_int16(offsets);
+    if (image_count <= 0 || !(offsets = max_reader_peek(reader, image_count * sizeof(guint32)))) {
+        return FALSE;
+    }
+
+    for (gint i = 0; i < image_count; ++i) {
+        const guchar *pointer;
+        gint frame_width;
+        gint frame_height;
+        gint hotx;
+        gint hoty;
+
+        if (!max_reader_seek(reader, (guint32)max_get_int32(&offsets[i * sizeof(guint32)])) ||
+            !(pointer = max_reader_peek(reader, 4 * sizeof(gint16)))) {
+            return FALSE;
+        }
+
+        frame_width = max_get_int16(&pointer[0]);
+        frame_height = max_get_int16(&pointer[2]);
+        hotx = max_get_int16(&pointer[4]);
+        hoty = max_get_int16(&pointer[6]);
+
+        if (frame_width <= 0 || frame_height <= 0) {
+            return FALSE;
+        }
+
+        *ulx = MAX(hotx, *ulx);
+        *uly = MAX(hoty, *uly);
+        lrx = MAX(frame_width - hotx, lrx);
+        lry = MAX(frame_height - hoty, lry);
+    }
+
+    *width = *ulx + lrx;
+    *height = *uly + lry;
+
+    return *width <= G_MAXINT16 && *height <= G_MAXINT16;
+}
+
+/**
+ * Decodes the Big image rows selected by row_map into rows. Tokens are walked through in full, but pixels are only
+ * stored for the sampled rows.
+ */
+gboolean decode_max_preview_rows(const struct MaxHeader *header, const gint *row_map, guchar *rows) {
+    const guchar *pointer = header->payload;
+    const guchar *end = header->payload + header->payload_size;
+    gsize image_size = (gsize)header->width * header->height;
+    gsize position = 0;
+
+    while (position < image_size) {
+        const guchar *source;
+        gboolean repeat_mode;
+        gint option_word;
+
+        if (end - pointer < (gssize)sizeof(gint16)) {
+            return FALSE;
+        }
+
+        option_word = max_get_int16(pointer);
+        pointer += sizeof(gint16);
+        source = pointer;
+        repeat_mode = option_word <= 0;
+
+        if (repeat_mode) {
+            option_word = -option_word;
+            pointer += sizeof(guchar);
+        } else {
+            pointer += option_word;
+        }
+
+        if (pointer > end || option_word > image_size - position) {
+            return FALSE;
+        }
+
+        while (option_word) {
+            gint row = position / header->width;
+            gint column = position % header->width;
+            gint count = MIN(option_word, header->width - column);
+
+            if (row_map[row] != -1) {
+                guchar *destination = &rows[(gsize)row_map[row] * header->width + column];
+
+                if (repeat_mode) {
+                    memset(destination, source[0], count);
+                } else {
+                    memcpy(destination, source, count);
+                    source += count;
+                }
+            } else if (!repeat_mode) {
+                source += count;
+            }
+
+            position += count;
+            option_word -= count;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * Samples the columns of the decoded preview rows and converts them to RGB.
+ */
+void max_preview_shrink(struct MaxImage *preview, const guchar *rows, gint row_width, const guchar *palette) {
+    guchar *pixel = preview->pixels;
+
+    for (gint y = 0; y < preview->height; ++y) {
+        const guchar *row = &rows[(gsize)y * row_width];
+
+        for (gint x = 0; x < preview->width; ++x) {
+            const guchar *color = &palette[3 * row[(gsize)x * row_width / preview->width]];
+
+            pixel[0] = color[0];
+            pixel[1] = color[1];
+            pixel[2] = color[2];
+            pixel += 3;
+        }
+    }
+}
+
+/**
+ * Decodes an RGB preview that fits into a preview_size square. Simple and Big images only decode the rows that are
+ * sampled, Multi and Shadow files only decode their first frame. The header receives the full image size.
+ */
+struct MaxImage *decode_max_preview(const guchar *data, gsize size, gint preview_size, struct MaxHeader *header,
+                                    GError **error) {
+    struct MaxImage *preview;
+    struct MaxMultiImage *frame = NULL;
+    const guchar *palette = max_default_palette;
+    guchar *rows = NULL;
+    gint *row_map = NULL;
+    gint frame_x = 0;
+    gint frame_y = 0;
+    gint width;
+    gint height;
+    gint scale;
+    gboolean result = TRUE;
+
+    switch (sniff_max_format(data, size, size, header)) {
+        case MAX_FORMAT_SIMPLE:
+        case MAX_FORMAT_BIG: {
+            width = header->width;
+            height = header->height;
+        } break;
+        case MAX_FORMAT_MULTI: {
+            struct MaxReader reader;
+            gint format = MAX_FORMAT_AUTO;
+
+            max_reader_init(&reader, data, size);
+
+            /* the preview shows the first frame only, but on the canvas the loaded image will have */
+            if (read_max_multi_canvas(&reader, &frame_x, &frame_y, &width, &height)) {
+                frame = read_max_multi_image(&reader, max_get_int32(&data[sizeof(gint16)]), &format);
+            }
+
+            if (!frame) {
+                g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+                return NULL;
+            }
+
+            frame_x -= frame->hotx;
+            frame_y -= frame->hoty;
+            header->width = width;
+            header->height = height;
+        } break;
+        default: {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format not recognized.");
+            return NULL;
+        } break;
+    }
+
+    preview = g_malloc0(sizeof(struct MaxImage));
+    scale = MAX(width, height);
+
+    if (preview_size <= 0 || preview_size > scale) {
+        preview_size = scale;
+    }
+
+    preview->width = MAX(1, width * preview_size / scale);
+    preview->height = MAX(1, height * preview_size / scale);
+    preview->pixels = g_malloc(3 * preview->width * preview->height);
+
+    if (frame) {
+        rows = g_malloc0((gsize)preview->height * width);
+
+        for (gint y = 0; y < preview->height; ++y) {
+            gint frame_row = y * height / preview->height - frame_y;
+            const guchar *pixel;
+
+            if (frame_row < 0 || frame_row >= frame->height) {
+                continue;
+            }
+
+            pixel = &frame->pixels[MULTI_PIXEL_SIZE * (gsize)frame_row * frame->width];
+
+            for (gint x = 0; x < frame->width; ++x) {
+                rows[(gsize)y * width + frame_x + x] = pixel[MULTI_PIXEL_SIZE * x];
+            }
+        }
+    } else if (header->format == MAX_FORMAT_SIMPLE) {
+        rows = g_malloc((gsize)preview->height * width);
+
+        for (gint y = 0; y < preview->height; ++y) {
+            memcpy(&rows[(gsize)y * width], &header->payload[(gsize)(y * height / preview->height) * width], width);
+        }
+    } else {
+        rows = g_malloc0((gsize)preview->height * width);
+        row_map = g_malloc(height * sizeof(gint));
+        palette = header->palette;
+
+        for (gint y = 0; y < height; ++y) {
+            row_map[y] = -1;
+        }
+
+        for (gint y = 0; y < preview->height; ++y) {
+            row_map[y * height / preview->height] = y;
+        }
+
+        result = decode_max_preview_rows(header, row_map, rows);
+    }
+
+    if (result) {
+        max_preview_shrink(preview, rows, width, palette);
+    } else {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
+        max_image_free(preview);
+        preview = NULL;
+    }
+
+    g_free(row_map);
+    g_free(rows);
+    max_multi_image_free(frame);
+
+    return preview;
+}
+
+/**
+ * Size of the greedy encoding of the given rows without producing it. The pattern check does not look ahead past the
+ * last row, so estimates of sampled rows may differ from the encoded size by a few bytes.
+ */
+gsize image_rle_estimate(const guchar *buffer, gint rows, gint rowstride) {
+    gsize size = (gsize)rows * rowstride;
+    gsize estimate = 0;
+
+    for (gint i = 0; i < rows; ++i) {
+        gsize row_end = (gsize)(i + 1) * rowstride;
+        gsize start_position = (gsize)i * rowstride;
+
+        while (start_position < row_end) {
+            gsize pattern_position = row_end - 1;
+            gsize literal_size;
+            gsize end_position = row_end;
+
+            if (rowstride > RLE_BREAK_EVEN) {
+                pattern_position = max_find_pattern(buffer, start_position, row_end - 1, size);
+            }
+
+            if (pattern_position == row_end - 1) {
+                pattern_position = row_end;
+            } else {
+                end_position = max_find_mismatch(buffer, pattern_position + 2, row_end, buffer[pattern_position]);
+                estimate += (sizeof(gint16) + sizeof(guchar)) *
+                            ((end_position - pattern_position + G_MAXINT16 - 1) / G_MAXINT16);
+            }
+
+            literal_size = pattern_position - start_position;
+            estimate += literal_size + sizeof(gint16) * ((literal_size + G_MAXINT16 - 1) / G_MAXINT16);
+
+            start_position = end_position;
+        }
+    }
+
+    return estimate;
+}
+
+/**
+ * Minimum size encoder. cost[j] is the size of the smallest encoding of the first j bytes of a row. Tokens cover at
+ * most G_MAXINT16 bytes, longer spans are chains of tokens and pay the overhead of every one of them. The last token
+ * is either a literal that starts at the cheapest position within reach or a repeat that starts as early as the run
+ * of equal bytes ending at j and the token limit allow, as cost never decreases with j.
+ */
+gboolean image_rle_encode_smallest(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride) {
+    gint *cost;
+    gint *start;
+    gint *tokens;
+    gint *window;
+    const gint literal_cost = sizeof(gint16);
+    const gint repeat_cost = sizeof(gint16) + sizeof(guchar);
+    gboolean result = TRUE;
+
+    if (!writer || rows < 0 || rowstride <= 0) {
+        return FALSE;
+    }
+
+    cost = g_malloc((rowstride + 1) * sizeof(gint));
+    start = g_malloc((rowstride + 1) * sizeof(gint));
+    tokens = g_malloc((rowstride + 1) * sizeof(gint));
+    window = g_malloc((rowstride + 1) * sizeof(gint));
+
+    for (gint y = 0; result && y < rows; ++y) {
+        const guchar *row = &buffer[(gsize)y * rowstride];
+        gint window_head = 0;
+        gint window_tail = 0;
+        gint run_start = 0;
+        gint count = 0;
+
+        cost[0] = 0;
+
+        for (gint j = 1; j <= rowstride; ++j) {
+            gint literal_start;
+            gint repeat_start;
+
+            if (j > 1 && row[j - 1] != row[j - 2]) {
+                run_start = j - 1;
+            }
+
+            /* window holds the literal starts within reach in increasing order of cost[i] - i */
+            while (window_tail > window_head && cost[window[window_tail - 1]] - window[window_tail - 1] >=
+                                                    cost[j - 1] - (j - 1)) {
+                --window_tail;
+            }
+
+            window[window_tail++] = j - 1;
+
+            if (window[window_head] < j - G_MAXINT16) {
+                ++window_head;
+            }
+
+            literal_start = window[window_head];
+            repeat_start = MAX(run_start, j - G_MAXINT16);
+
+            /* a negative start marks a repeat token */
+            cost[j] = cost[literal_start] + literal_cost + (j - literal_start);
+            start[j] = literal_start;
+
+            if (cost[repeat_start] + repeat_cost < cost[j]) {
+                cost[j] = cost[repeat_start] + repeat_cost;
+                start[j] = -repeat_start - 1;
+            }
+        }
+
+        for (gint j = rowstride; j > 0; j = start[j] < 0 ? -start[j] - 1 : start[j]) {
+            tokens[count++] = j;
+        }
+
+        for (gint i = count - 1, position = 0; result && i >= 0; --i) {
+            gint end = tokens[i];
+            gboolean repeat_mode = start[end] < 0;
+
+            result = image_rle_encode_emit(writer, &row[position], end - position, repeat_mode);
+            position = end;
+        }
+    }
+
+    g_free(window);
+    g_free(tokens);
+    g_free(start);
+    g_free(cost);
+
+    return result;
+}
+
+gboolean encode_max_simple(struct MaxWriter *writer, const struct MaxImage *image, GError **error) {
+    if (!image->pixels) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
+                    image->width, image->height);
+        return FALSE;
+    }
+
+    if (!encode_max_simple_header(writer, image, error)) {
+        return FALSE;
+    }
+
+    if (!max_writer_append(writer, image->pixels, image->width * image->height)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Writes the header of a Simple image, the pixels are expected to be appended by the caller.
+ */
+gboolean encode_max_simple_header(struct MaxWriter *writer, const struct MaxImage *image, GError **error) {
+    guchar *pointer;
+
+    if (image->width <= 0 || image->height <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
+                    image->width, image->height);
+        return FALSE;
+    }
+
+    pointer = max_writer_reserve(writer, 4 * sizeof(gint16));
+    if (!pointer) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        return FALSE;
+    }
+
+    max_put_int16(&pointer[0], image->width);
+    max_put_int16(&pointer[2], image->height);
+    max_put_int16(&pointer[4], image->hotx);
+    max_put_int16(&pointer[6], image->hoty);
+
+    return TRUE;
+}
+
+gboolean encode_max_big(struct MaxWriter *writer, const struct MaxImage *image, gint rle_mode, GError **error) {
+    if (!image->pixels) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
+                    image->width, image->height);
+        return FALSE;
+    }
+
+    if (!encode_max_big_header(writer, image, error)) {
+        return FALSE;
+    }
+
+    return encode_max_big_rows(writer, image->pixels, image->height, image->width, FALSE, rle_mode, error);
+}
+
+/**
+ * Writes the header and the palette of a Big image, the rows are expected to follow through encode_max_big_rows().
+ */
+gboolean encode_max_big_header(struct MaxWriter *writer, const struct MaxImage *image, GError **error) {
+    guchar *pointer;
+
+    if (image->width <= 0 || image->height <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %i, height: %i).",
+                    image->width, image->height);
+        return FALSE;
+    }
+
+    pointer = max_writer_reserve(writer, 4 * sizeof(gint16) + PALETTE_SIZE);
+    if (!pointer) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        return FALSE;
+    }
+
+    max_put_int16(&pointer[0], image->hotx);
+    max_put_int16(&pointer[2], image->hoty);
+    max_put_int16(&pointer[4], image->width);
+    max_put_int16(&pointer[6], image->height);
+    memcpy(&pointer[8], image->palette ? image->palette : max_default_palette, PALETTE_SIZE);
+
+    return TRUE;
+}
+
+/**
+ * Encodes a band of rows of a Big image. If lookahead is set, the row after the band has to be present in pixels, the
+ * greedy mode then emits the same tokens as for the whole image. Bands of the smallest mode with tokens across rows
+ * should be RLE_SMALLEST_CHUNK_SIZE bytes long to match the whole image, while the greedy mode with tokens across
+ * rows breaks its tokens at the band boundaries.
+ */
+gboolean encode_max_big_rows(struct MaxWriter *writer, const guchar *pixels, gint rows, gint width, gboolean lookahead,
+                             gint rle_mode, GError **error) {
+    gboolean result;
+
+    if (rle_mode == (MAX_RLE_SMALLEST | MAX_RLE_CROSS_ROW)) {
+        /* the row span of the optimizer is limited to bound its working memory */
+        gint chunk_rows = MAX(1, RLE_SMALLEST_CHUNK_SIZE / width);
+
+        result = TRUE;
+
+        for (gint y = 0; result && y < rows; y += chunk_rows) {
+            result = image_rle_encode_smallest(writer, &pixels[(gsize)y * width], 1, MIN(chunk_rows, rows - y) * width);
+        }
+    } else if (rle_mode == MAX_RLE_SMALLEST) {
+        result = image_rle_encode_smallest(writer, pixels, rows, width);
+    } else if (rle_mode == MAX_RLE_CROSS_ROW) {
+        result = image_rle_encode(writer, pixels, 1, rows * width);
+    } else {
+        result = image_rle_encode_rows(writer, pixels, rows, width, (gsize)(rows + (lookahead ? 1 : 0)) * width);
+    }
+
+    if (!result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image encode error.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Encodes a frame cropped to the bounding box of its opaque pixels. Transparent spans longer than 254 pixels are split
+ * with empty pixel spans as 0xFF terminates the row. Shadow frames only store the span lengths.
+ */
+gboolean encode_max_multi_image(struct MaxWriter *writer, const struct MaxMultiImage *image, gint format) {
+    gint left = image->width;
+    gint top = image->height;
+    gint right = 0;
+    gint bottom = 0;
+    guchar *pointer;
+    gsize row_table;
+
+    for (gint y = 0; y < image->height; ++y) {
+        const guchar *row = &image->pixels[MULTI_PIXEL_SIZE * (gsize)y * image->width];
+        gint first = max_find_alpha(row, 0, image->width, TRUE);
+        gint last = image->width;
+
+        if (first < image->width) {
+            while (!row[MULTI_PIXEL_SIZE * (last - 1) + 1]) {
+                --last;
+            }
+
+            left = MIN(left, first);
+            right = MAX(right, last);
+            top = MIN(top, y);
+            bottom = MAX(bottom, y + 1);
+        }
+    }
+
+    /* fully transparent frames keep a single transparent pixel at their origin */
+    if (left >= right) {
+        left = 0;
+        right = 1;
+        top = 0;
+        bottom = 1;
+    }
+
+    pointer = max_writer_reserve(writer, 4 * sizeof(gint16) + (bottom - top) * sizeof(gint32));
+    if (!pointer) {
+        return FALSE;
+    }
+
+    max_put_int16(&pointer[0], right - left);
+    max_put_int16(&pointer[2], bottom - top);
+    max_put_int16(&pointer[4], image->hotx - left);
+    max_put_int16(&pointer[6], image->hoty - top);
+
+    row_table = 4 * sizeof(gint16);
+
+    for (gint y = top; y < bottom; ++y) {
+        const guchar *row = &image->pixels[MULTI_PIXEL_SIZE * ((gsize)y * image->width + left)];
+        gint width = right - left;
+        gint x = 0;
+
+        max_put_int32(&writer->data[row_table], max_writer_get_size(writer));
+        row_table += sizeof(gint32);
+
+        for (;;) {
+            gint transparent_count = max_find_alpha(row, x, width, TRUE) - x;
+            gint pixel_count;
+
+            x += transparent_count;
+
+            if (x == width) {
+                break;
+            }
+
+            for (; transparent_count > 254; transparent_count -= 254) {
+                pointer = max_writer_reserve(writer, 2 * sizeof(guchar));
+                if (!pointer) {
+                    return FALSE;
+                }
+
+                pointer[0] = 254;
+                pointer[1] = 0;
+            }
+
+            pixel_count = max_find_alpha(row, x, MIN(width, x + 255), FALSE) - x;
+
+            pointer = max_writer_reserve(writer, 2 * sizeof(guchar) + (format == MAX_FORMAT_SHADOW ? 0 : pixel_count));
+            if (!pointer) {
+                return FALSE;
+            }
+
+            pointer[0] = transparent_count;
+            pointer[1] = pixel_count;
+
+            if (format != MAX_FORMAT_SHADOW) {
+                for (gint i = 0; i < pixel_count; ++i) {
+                    pointer[2 + i] = row[MULTI_PIXEL_SIZE * (x + i)];
+                }
+            }
+
+            x += pixel_count;
+        }
+
+        if (!max_writer_append(writer, "\xFF", sizeof(guchar))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+void encode_max_multi_task(gpointer data, gpointer user_data) {
+    struct MaxMultiEncodeTask *task = data;
+
+    max_writer_init(&task->writer, NULL);
+
+    task->result = encode_max_multi_image(&task->writer, task->image, task->format);
+}
+
+/**
+ * Encodes the frames on a thread pool into separate buffers and assembles the offset table, the row tables and the
+ * frame data in order.
+ */
+gboolean encode_max_frames(struct MaxWriter *writer, const struct MaxMulti *multi, gint format, GError **error) {
+    struct MaxMultiEncodeTask *tasks;
+    GThreadPool *pool;
+    guchar *pointer;
+    gsize offset;
+    gboolean result = TRUE;
+
+    if (multi->image_count <= 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        return FALSE;
+    }
+
+    tasks = g_malloc0(multi->image_count * sizeof(struct MaxMultiEncodeTask));
+    if (!tasks) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        return FALSE;
+    }
+
+    pool = g_thread_pool_new(encode_max_multi_task, NULL, MIN(g_get_num_processors(), multi->image_count), FALSE,
+                             NULL);
+
+    for (gint i = 0; i < multi->image_count; ++i) {
+        tasks[i].image = multi->images[i];
+        tasks[i].format = format;
+
+        if (!pool || !g_thread_pool_push(pool, &tasks[i], NULL)) {
+            encode_max_multi_task(&tasks[i], NULL);
+        }
+    }
+
+    if (pool) {
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+
+    offset = max_writer_get_size(writer) + sizeof(gint16) + multi->image_count * sizeof(guint32);
+
+    pointer = max_writer_reserve(writer, sizeof(gint16) + multi->image_count * sizeof(guint32));
+    if (pointer) {
+        max_put_int16(pointer, multi->image_count);
+        pointer += sizeof(gint16);
+
+        for (gint i = 0; i < multi->image_count; ++i) {
+            if (!tasks[i].result || offset + tasks[i].writer.length > G_MAXINT32) {
+                result = FALSE;
+                break;
+            }
+
+            max_put_int32(&pointer[i * sizeof(guint32)], offset);
+            offset += tasks[i].writer.length;
+        }
+    } else {
+        result = FALSE;
+    }
+
+    for (gint i = 0; result && i < multi->image_count; ++i) {
+        struct MaxWriter *frame = &tasks[i].writer;
+        gint height = max_get_int16(&frame->data[2]);
+        gsize base = max_writer_get_size(writer);
+
+        for (gint y = 0; y < height; ++y) {
+            guchar *row = &frame->data[4 * sizeof(gint16) + y * sizeof(gint32)];
+
+            max_put_int32(row, max_get_int32(row) + base);
+        }
+
+        result = max_writer_append(writer, frame->data, frame->length);
+    }
+
+    for (gint i = 0; i < multi->image_count; ++i) {
+        max_writer_free(&tasks[i].writer);
+    }
+
+    g_free(tasks);
+
+    if (!result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image encode error.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean encode_max_multi(struct MaxWriter *writer, const struct MaxMulti *multi, GError **error) {
+    return encode_max_frames(writer, multi, MAX_FORMAT_MULTI, error);
+}
+
+/**
+ * Every opaque pixel of the frames becomes part of a shadow span, the palette indices are not stored.
+ */
+gboolean encode_max_shadow(struct MaxWriter *writer, const struct MaxMulti *multi, GError **error) {
+    return encode_max_frames(writer, multi, MAX_FORMAT_SHADOW, error);
+}
+
+void max_image_free(struct MaxImage *image) {
+    if (image) {
+        g_free(image->pixels);
+        g_free(image->palette);
+        g_free(image);
+    }
+}
+
+void max_multi_image_free(struct MaxMultiImage *image) {
+    if (image) {
+        g_free(image->rows);
+        g_free(image->pixels);
+        g_free(image);
+    }
+}
+
+void max_multi_free(struct MaxMulti *multi) {
+    if (multi) {
+        if (multi->images) {
+            for (gint i = 0; i < multi->image_count; ++i) {
+                max_multi_image_free(multi->images[i]);
+            }
+        }
+
+        g_free(multi->images);
+        g_free(multi);
+    }
+}
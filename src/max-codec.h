@@ -0,0 +1,194 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MAX_CODEC_H
+#define MAX_CODEC_H
+
+#include <glib.h>
+#include <stdio.h>
+
+#define PALETTE_COLORS 256
+#define PALETTE_SIZE PALETTE_COLORS *(sizeof(guchar) + sizeof(guchar) + sizeof(guchar))
+#define RLE_BREAK_EVEN (2 * sizeof(gint16) + sizeof(guchar))
+#define RLE_SMALLEST_CHUNK_SIZE (1024 * 1024)
+#define MAX_BAND_SIZE (1024 * 1024)
+#define MAX_SNIFF_SIZE 32
+#define MULTI_PIXEL_SIZE 2
+#define MAX_WRITER_CHUNK_SIZE (1024 * 1024)
+
+enum MaxFormatTypes {
+    MAX_FORMAT_AUTO,
+    MAX_FORMAT_SIMPLE,
+    MAX_FORMAT_BIG,
+    MAX_FORMAT_MULTI,
+    MAX_FORMAT_SHADOW,
+};
+
+/** Token selection of the Big encoder. The fast mode is greedy, the smallest mode finds the minimum size encoding of
+ * every row. Either mode may be combined with MAX_RLE_CROSS_ROW to let tokens continue into the next row.
+ */
+enum MaxRleModes {
+    MAX_RLE_FAST = 0x0,
+    MAX_RLE_SMALLEST = 0x1,
+    MAX_RLE_CROSS_ROW = 0x2,
+};
+
+/** Single frame image used by the Simple and Big formats. The palette is only present in Big images, previews hold
+ * RGB pixels without a palette.
+ */
+struct MaxImage {
+    gint16 width;
+    gint16 height;
+    gint16 hotx;
+    gint16 hoty;
+    guchar *pixels;
+    guchar *palette;
+};
+
+/** Frame of a Multi or Shadow file. Pixels are stored as pairs of palette index and alpha, transparent spans are
+ * left fully transparent.
+ */
+struct MaxMultiImage {
+    gint32 file_offset;
+    gint16 width;
+    gint16 height;
+    gint16 hotx;
+    gint16 hoty;
+    gint32 *rows;
+    guchar *pixels;
+};
+
+/** Header of a Simple or Big image. The palette and the payload point into the file data. Multi and Shadow files
+ * only report their image count.
+ */
+struct MaxHeader {
+    gint format;
+    gint16 image_count;
+    gint16 width;
+    gint16 height;
+    gint16 hotx;
+    gint16 hoty;
+    const guchar *palette;
+    const guchar *payload;
+    gsize payload_size;
+};
+
+/** Frame set used by the Multi and Shadow formats. */
+struct MaxMulti {
+    gint16 image_count;
+    struct MaxMultiImage **images;
+};
+
+/** Read cursor over an in-memory file image. */
+struct MaxReader {
+    const guchar *data;
+    gsize size;
+    gsize position;
+};
+
+/** Growable output buffer of the encoders. If a file is attached, the buffer is written to it in chunks of
+ * MAX_WRITER_CHUNK_SIZE bytes, otherwise everything is kept in memory until max_writer_flush() is called.
+ */
+struct MaxWriter {
+    guchar *data;
+    gsize length;
+    gsize capacity;
+    gsize flushed;
+    FILE *fd;
+    gboolean failed;
+};
+
+/** Incremental Big RLE decoder. Tokens may span several calls of image_rle_decoder_read(). */
+struct MaxRleDecoder {
+    const guchar *pointer;
+    const guchar *end;
+    gint remaining;
+    gboolean repeat_mode;
+    guchar value;
+};
+
+extern const guchar max_default_palette[PALETTE_SIZE];
+
+static inline gint16 max_get_int16(const guchar *data) { return (gint16)(data[0] | (data[1] << 8)); }
+
+static inline void max_put_int16(guchar *data, gint16 value) {
+    data[0] = (guint16)value & 0xFF;
+    data[1] = (guint16)value >> 8;
+}
+
+static inline gint32 max_get_int32(const guchar *data) {
+    return (gint32)((guint32)data[0] | ((guint32)data[1] << 8) | ((guint32)data[2] << 16) | ((guint32)data[3] << 24));
+}
+
+static inline void max_put_int32(guchar *data, gint32 value) {
+    data[0] = (guint32)value & 0xFF;
+    data[1] = ((guint32)value >> 8) & 0xFF;
+    data[2] = ((guint32)value >> 16) & 0xFF;
+    data[3] = (guint32)value >> 24;
+}
+
+void max_reader_init(struct MaxReader *reader, const guchar *data, gsize size);
+gboolean max_reader_read(struct MaxReader *reader, gpointer buffer, gsize size);
+const guchar *max_reader_peek(struct MaxReader *reader, gsize size);
+gboolean max_reader_seek(struct MaxReader *reader, gsize position);
+gsize max_reader_tell(struct MaxReader *reader);
+
+void max_writer_init(struct MaxWriter *writer, FILE *fd);
+guchar *max_writer_reserve(struct MaxWriter *writer, gsize size);
+gboolean max_writer_append(struct MaxWriter *writer, gconstpointer data, gsize size);
+gboolean max_writer_flush(struct MaxWriter *writer, FILE *fd);
+gsize max_writer_get_size(const struct MaxWriter *writer);
+void max_writer_free(struct MaxWriter *writer);
+
+gboolean image_rle_decode(struct MaxReader *reader, gint data_size, guchar *pixels, gint width, gint height);
+void image_rle_decoder_init(struct MaxRleDecoder *decoder, const guchar *data, gsize size);
+gboolean image_rle_decoder_read(struct MaxRleDecoder *decoder, guchar *pixels, gsize size);
+gboolean image_rle_encode(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride);
+gsize image_rle_estimate(const guchar *buffer, gint rows, gint rowstride);
+gboolean image_rle_encode_smallest(struct MaxWriter *writer, const guchar *buffer, gint rows, gint rowstride);
+
+gint sniff_max_format(const guchar *data, gsize size, gsize file_size, struct MaxHeader *header);
+gint probe_max_file(const gchar *filename, struct MaxHeader *header, GError **error);
+
+gboolean read_max_simple_header(const guchar *data, gsize size, struct MaxHeader *header, GError **error);
+gboolean read_max_big_header(const guchar *data, gsize size, struct MaxHeader *header, GError **error);
+
+struct MaxImage *decode_max_simple(const guchar *data, gsize size, GError **error);
+struct MaxImage *decode_max_big(const guchar *data, gsize size, GError **error);
+struct MaxMulti *decode_max_multi(const guchar *data, gsize size, GError **error);
+gint decode_max_data(const guchar *data, gsize size, struct MaxImage **image, struct MaxMulti **multi,
+                     GError **error);
+struct MaxImage *decode_max_preview(const guchar *data, gsize size, gint preview_size, struct MaxHeader *header,
+                                    GError **error);
+
+gboolean encode_max_simple(struct MaxWriter *writer, const struct MaxImage *image, GError **error);
+gboolean encode_max_simple_header(struct MaxWriter *writer, const struct MaxImage *image, GError **error);
+gboolean encode_max_big(struct MaxWriter *writer, const struct MaxImage *image, gint rle_mode, GError **error);
+gboolean encode_max_big_header(struct MaxWriter *writer, const struct MaxImage *image, GError **error);
+gboolean encode_max_big_rows(struct MaxWriter *writer, const guchar *pixels, gint rows, gint width, gboolean lookahead,
+                             gint rle_mode, GError **error);
+gboolean encode_max_multi(struct MaxWriter *writer, const struct MaxMulti *multi, GError **error);
+gboolean encode_max_shadow(struct MaxWriter *writer, const struct MaxMulti *multi, GError **error);
+
+void max_image_free(struct MaxImage *image);
+void max_multi_free(struct MaxMulti *multi);
+
+#endif /* MAX_CODEC_H */
@@ -0,0 +1,1176 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "max-codec.h"
+#include "max-palette.h"
+#include "max-resource.h"
+
+#define MAX_CONVERT_VERSION "0.1"
+#define HOTSPOT_KEY "max-hotspot"
+#define PARTIAL_SUFFIX ".part"
+
+enum MaxConvertTargets {
+    CONVERT_TARGET_AUTO,
+    CONVERT_TARGET_MAX,
+    CONVERT_TARGET_PNG,
+    CONVERT_TARGET_PPM,
+};
+
+struct MaxConvertSettings {
+    gint target;
+    gint file_type;
+    gint rle_mode;
+    gint palette_mode;
+    gint dither_mode;
+    gchar *output_dir;
+    gchar *archive;
+    gboolean recursive;
+    gboolean force;
+    gint jobs;
+    gboolean verbose;
+};
+
+/** Decoded picture exchanged with PNG and PPM files. Indexed rasters have one channel and a palette, true color
+ * rasters have three or four channels.
+ */
+struct MaxRaster {
+    gint width;
+    gint height;
+    gint channels;
+    gint16 hotx;
+    gint16 hoty;
+    guchar *pixels;
+    guchar palette[PALETTE_SIZE];
+    gint num_colors;
+};
+
+/** Conversion of one input file. The output of Multi and Shadow files is the name of the first frame. When packing
+ * an archive, M.A.X. inputs are queued as their own output and are only packed.
+ */
+struct MaxConvertJob {
+    gchar *input;
+    gchar *output;
+    gint target;
+    gint format;
+    gboolean failed;
+};
+
+/** Job deque of one worker. The owner takes jobs from the tail, idle workers steal from the head. */
+struct MaxWorkQueue {
+    GMutex mutex;
+    GQueue jobs;
+};
+
+struct MaxWorkPool {
+    const struct MaxConvertSettings *settings;
+    struct MaxWorkQueue *queues;
+    gint queue_count;
+    gint converted;
+    gint skipped;
+    gint failed;
+};
+
+struct MaxWorker {
+    struct MaxWorkPool *pool;
+    gint index;
+};
+
+static gboolean convert_parse_choice(const gchar *option, const gchar *value, const gchar *const *names,
+                                     gint *result, GError **error);
+static gboolean convert_is_image(const gchar *filename);
+static gchar *convert_get_output(const struct MaxConvertSettings *settings, const gchar *input, const gchar *root,
+                                 gint target, gint frame);
+static void convert_add_job(const struct MaxConvertSettings *settings, GPtrArray *jobs, const gchar *input,
+                            const gchar *root, gboolean explicit);
+static void convert_scan(const struct MaxConvertSettings *settings, GPtrArray *jobs, const gchar *path,
+                         const gchar *root);
+static gboolean convert_is_current(const gchar *input, const gchar *output);
+static FILE *convert_open_output(const gchar *filename, GError **error);
+static gboolean convert_close_output(const gchar *filename, FILE *fd, gboolean result, GError **error);
+static gboolean convert_read_png(const gchar *filename, struct MaxRaster *raster, GError **error);
+static gboolean convert_write_png(const gchar *filename, const struct MaxRaster *raster, GError **error);
+static gboolean convert_read_ppm(const gchar *filename, struct MaxRaster *raster, GError **error);
+static gboolean convert_write_ppm(const gchar *filename, const struct MaxRaster *raster, GError **error);
+static gboolean convert_write_raster(const gchar *filename, gint target, const struct MaxRaster *raster,
+                                     GError **error);
+static gboolean convert_from_max(const struct MaxConvertJob *job, GError **error);
+static guchar *convert_get_indices(const struct MaxConvertSettings *settings, const struct MaxRaster *raster,
+                                   gint file_type, guchar *palette);
+static gboolean convert_to_max(const struct MaxConvertSettings *settings, const struct MaxConvertJob *job,
+                               GError **error);
+static gboolean convert_run_job(const struct MaxConvertSettings *settings, const struct MaxConvertJob *job,
+                                gboolean *skipped, GError **error);
+static gboolean convert_pack(const struct MaxConvertSettings *settings, const GPtrArray *jobs, GError **error);
+static struct MaxConvertJob *convert_next_job(struct MaxWorkPool *pool, gint index);
+static gpointer convert_worker(gpointer data);
+static void convert_job_free(gpointer data);
+
+static const gchar *const target_names[] = {"auto", "max", "png", "ppm", NULL};
+static const gchar *const format_names[] = {"auto", "simple", "big", "multi", "shadow", NULL};
+static const gchar *const compression_names[] = {"fast", "smallest", "fast-rows", "smallest-rows", NULL};
+static const gchar *const palette_names[] = {"game", "optimized", "reserved", NULL};
+static const gchar *const dither_names[] = {"none", "ordered", "floyd-steinberg", NULL};
+
+gboolean convert_parse_choice(const gchar *option, const gchar *value, const gchar *const *names, gint *result,
+                              GError **error) {
+    if (!value) {
+        return TRUE;
+    }
+
+    for (gint i = 0; names[i]; ++i) {
+        if (g_ascii_strcasecmp(value, names[i]) == 0) {
+            *result = i;
+            return TRUE;
+        }
+    }
+
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Invalid value '%s' for --%s.", value, option);
+
+    return FALSE;
+}
+
+gboolean convert_is_image(const gchar *filename) {
+    gchar *name = g_ascii_strdown(filename, -1);
+    gboolean result =
+        g_str_has_suffix(name, ".png") || g_str_has_suffix(name, ".ppm") || g_str_has_suffix(name, ".pnm");
+
+    g_free(name);
+
+    return result;
+}
+
+/**
+ * Builds the output name of an input. The known extension of the input is replaced, frames of Multi and Shadow files
+ * get a three digit suffix. With an output directory the path of the input relative to its root is kept.
+ */
+gchar *convert_get_output(const struct MaxConvertSettings *settings, const gchar *input, const gchar *root,
+                          gint target, gint frame) {
+    static const gchar *const extensions[] = {"", ".max", ".png", ".ppm"};
+    gchar *base;
+    gchar *output;
+    gchar *name = g_ascii_strdown(input, -1);
+
+    if (settings->output_dir) {
+        const gchar *relative = input;
+
+        if (root && g_str_has_prefix(input, root)) {
+            relative = input + strlen(root);
+
+            while (G_IS_DIR_SEPARATOR(*relative)) {
+                ++relative;
+            }
+
+        } else {
+            relative = input + strlen(input);
+
+            while (relative > input && !G_IS_DIR_SEPARATOR(relative[-1])) {
+                --relative;
+            }
+        }
+
+        base = g_build_filename(settings->output_dir, relative, NULL);
+
+    } else {
+        base = g_strdup(input);
+    }
+
+    if (convert_is_image(name) || g_str_has_suffix(name, ".max")) {
+        gchar *dot = strrchr(base, '.');
+
+        if (dot) {
+            *dot = '\0';
+        }
+    }
+
+    if (frame >= 0) {
+        output = g_strdup_printf("%s-%03d%s", base, frame, extensions[target]);
+    } else {
+        output = g_strconcat(base, extensions[target], NULL);
+    }
+
+    g_free(name);
+    g_free(base);
+
+    return output;
+}
+
+/**
+ * Queues the conversion of a file. Images are converted to M.A.X. files and M.A.X. files to images unless a target is
+ * forced. Files found while scanning directories that are neither are skipped silently. So are images found while
+ * scanning without a forced target, as these are mostly earlier outputs. Converting them back would overwrite the
+ * M.A.X. file they came from and keep the directory from ever being up to date.
+ */
+void convert_add_job(const struct MaxConvertSettings *settings, GPtrArray *jobs, const gchar *input,
+                     const gchar *root, gboolean explicit) {
+    struct MaxConvertJob *job;
+    struct MaxHeader header;
+    gint target = settings->target;
+    gint format = -1;
+
+    if (convert_is_image(input)) {
+        if (!explicit && target == CONVERT_TARGET_AUTO) {
+            return;
+        }
+
+        if (target == CONVERT_TARGET_PNG || target == CONVERT_TARGET_PPM) {
+            if (explicit) {
+                g_printerr("max-convert: %s: Input is not a M.A.X. file.\n", input);
+            }
+
+            return;
+        }
+
+        target = CONVERT_TARGET_MAX;
+
+    } else {
+        format = probe_max_file(input, &header, NULL);
+
+        if (format > 0 && settings->archive) {
+            job = g_malloc0(sizeof(struct MaxConvertJob));
+            job->input = g_strdup(input);
+            job->output = g_strdup(input);
+            job->target = CONVERT_TARGET_MAX;
+            job->format = format;
+
+            g_ptr_array_add(jobs, job);
+
+            return;
+        }
+
+        if (format <= 0 || target == CONVERT_TARGET_MAX) {
+            if (explicit) {
+                g_printerr("max-convert: %s: Image format not recognized.\n", input);
+            }
+
+            return;
+        }
+
+        if (target == CONVERT_TARGET_AUTO) {
+            target = CONVERT_TARGET_PNG;
+        }
+    }
+
+    job = g_malloc0(sizeof(struct MaxConvertJob));
+    job->input = g_strdup(input);
+    job->target = target;
+    job->format = format;
+    job->output = convert_get_output(settings, input, root, target, format == MAX_FORMAT_MULTI ? 0 : -1);
+
+    g_ptr_array_add(jobs, job);
+}
+
+void convert_scan(const struct MaxConvertSettings *settings, GPtrArray *jobs, const gchar *path, const gchar *root) {
+    GError *error = NULL;
+    const gchar *name;
+    GDir *dir;
+
+    dir = g_dir_open(path, 0, &error);
+    if (!dir) {
+        g_printerr("max-convert: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    while ((name = g_dir_read_name(dir))) {
+        gchar *filename = g_build_filename(path, name, NULL);
+
+        if (g_file_test(filename, G_FILE_TEST_IS_DIR)) {
+            if (settings->recursive) {
+                convert_scan(settings, jobs, filename, root);
+            }
+
+        } else if (g_file_test(filename, G_FILE_TEST_IS_REGULAR) && !g_str_has_suffix(name, PARTIAL_SUFFIX)) {
+            convert_add_job(settings, jobs, filename, root, FALSE);
+        }
+
+        g_free(filename);
+    }
+
+    g_dir_close(dir);
+}
+
+gboolean convert_is_current(const gchar *input, const gchar *output) {
+    GStatBuf input_stat;
+    GStatBuf output_stat;
+
+    if (g_stat(input, &input_stat) != 0 || g_stat(output, &output_stat) != 0) {
+        return FALSE;
+    }
+
+    return output_stat.st_mtime >= input_stat.st_mtime;
+}
+
+/**
+ * Outputs are written next to their final name and renamed once complete, so an interrupted run never leaves an up
+ * to date looking partial file behind.
+ */
+FILE *convert_open_output(const gchar *filename, GError **error) {
+    gchar *partial = g_strconcat(filename, PARTIAL_SUFFIX, NULL);
+    gchar *dirname = g_path_get_dirname(filename);
+    FILE *fd = NULL;
+
+    if (g_mkdir_with_parents(dirname, 0755) == 0) {
+        fd = g_fopen(partial, "wb");
+    }
+
+    if (!fd) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for writing: %s",
+                    partial, g_strerror(errno));
+    }
+
+    g_free(dirname);
+    g_free(partial);
+
+    return fd;
+}
+
+gboolean convert_close_output(const gchar *filename, FILE *fd, gboolean result, GError **error) {
+    gchar *partial = g_strconcat(filename, PARTIAL_SUFFIX, NULL);
+
+    if (EOF == fclose(fd) && result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Failed to close '%s'.", partial);
+        result = FALSE;
+    }
+
+    if (result && g_rename(partial, filename) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not rename '%s': %s", partial,
+                    g_strerror(errno));
+        result = FALSE;
+    }
+
+    if (!result) {
+        g_unlink(partial);
+    }
+
+    g_free(partial);
+
+    return result;
+}
+
+/**
+ * Reads a PNG file. Palette images without transparency are kept indexed, everything else is expanded to 8 bit RGB or
+ * RGBA. The hotspot is restored from the text chunk written by convert_write_png().
+ */
+gboolean convert_read_png(const gchar *filename, struct MaxRaster *raster, GError **error) {
+    png_structp png;
+    png_infop info;
+    png_textp text = NULL;
+    png_bytep *volatile rows = NULL;
+    png_uint_32 width;
+    png_uint_32 height;
+    gint bit_depth;
+    gint color_type;
+    gint num_text = 0;
+    FILE *fd;
+
+    fd = g_fopen(filename, "rb");
+    if (!fd) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for reading: %s",
+                    filename, g_strerror(errno));
+        return FALSE;
+    }
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png ? png_create_info_struct(png) : NULL;
+
+    if (!info) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        png_destroy_read_struct(&png, NULL, NULL);
+        fclose(fd);
+        return FALSE;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File decode error.");
+        png_destroy_read_struct(&png, &info, NULL);
+        g_free(rows);
+        g_free(raster->pixels);
+        raster->pixels = NULL;
+        fclose(fd);
+        return FALSE;
+    }
+
+    png_init_io(png, fd);
+    png_read_info(png, info);
+    png_get_IHDR(png, info, &width, &height, &bit_depth, &color_type, NULL, NULL, NULL);
+
+    if (width > G_MAXINT16 || height > G_MAXINT16) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error (width: %u, height: %u).", width,
+                    height);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(fd);
+        return FALSE;
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE && !png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_colorp colors;
+
+        png_get_PLTE(png, info, &colors, &raster->num_colors);
+
+        for (gint i = 0; i < raster->num_colors && i < PALETTE_COLORS; ++i) {
+            raster->palette[3 * i] = colors[i].red;
+            raster->palette[3 * i + 1] = colors[i].green;
+            raster->palette[3 * i + 2] = colors[i].blue;
+        }
+
+        png_set_packing(png);
+
+    } else {
+        png_set_expand(png);
+        png_set_strip_16(png);
+        png_set_gray_to_rgb(png);
+    }
+
+    png_read_update_info(png, info);
+
+    raster->width = width;
+    raster->height = height;
+    raster->channels = png_get_channels(png, info);
+    raster->pixels = g_malloc((gsize)width * height * raster->channels);
+    rows = g_malloc(height * sizeof(png_bytep));
+
+    for (png_uint_32 y = 0; y < height; ++y) {
+        rows[y] = &raster->pixels[(gsize)y * width * raster->channels];
+    }
+
+    png_read_image(png, rows);
+    png_read_end(png, info);
+
+    if (png_get_text(png, info, &text, &num_text) > 0) {
+        for (gint i = 0; i < num_text; ++i) {
+            if (strcmp(text[i].key, HOTSPOT_KEY) == 0) {
+                sscanf(text[i].text, "%hd %hd", &raster->hotx, &raster->hoty);
+            }
+        }
+    }
+
+    png_destroy_read_struct(&png, &info, NULL);
+    g_free(rows);
+    fclose(fd);
+
+    return TRUE;
+}
+
+gboolean convert_write_png(const gchar *filename, const struct MaxRaster *raster, GError **error) {
+    static const gint color_types[] = {0, PNG_COLOR_TYPE_PALETTE, 0, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+    png_structp png;
+    png_infop info;
+    png_text text;
+    png_color colors[PALETTE_COLORS];
+    gchar hotspot[32];
+    FILE *fd;
+
+    fd = convert_open_output(filename, error);
+    if (!fd) {
+        return FALSE;
+    }
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png ? png_create_info_struct(png) : NULL;
+
+    if (!info) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOMEM, "Not enough memory.");
+        png_destroy_write_struct(&png, NULL);
+        return convert_close_output(filename, fd, FALSE, error);
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+        png_destroy_write_struct(&png, &info);
+        return convert_close_output(filename, fd, FALSE, error);
+    }
+
+    png_init_io(png, fd);
+    png_set_IHDR(png, info, raster->width, raster->height, 8, color_types[raster->channels], PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    if (raster->channels == 1) {
+        for (gint i = 0; i < PALETTE_COLORS; ++i) {
+            colors[i].red = raster->palette[3 * i];
+            colors[i].green = raster->palette[3 * i + 1];
+            colors[i].blue = raster->palette[3 * i + 2];
+        }
+
+        png_set_PLTE(png, info, colors, PALETTE_COLORS);
+    }
+
+    g_snprintf(hotspot, sizeof(hotspot), "%i %i", raster->hotx, raster->hoty);
+    memset(&text, 0, sizeof(text));
+    text.compression = PNG_TEXT_COMPRESSION_NONE;
+    text.key = HOTSPOT_KEY;
+    text.text = hotspot;
+    png_set_text(png, info, &text, 1);
+
+    png_write_info(png, info);
+
+    for (gint y = 0; y < raster->height; ++y) {
+        png_write_row(png, &raster->pixels[(gsize)y * raster->width * raster->channels]);
+    }
+
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+
+    return convert_close_output(filename, fd, TRUE, error);
+}
+
+/**
+ * Reads a binary PPM file with 8 bit samples. The hotspot is restored from the comment written by
+ * convert_write_ppm().
+ */
+gboolean convert_read_ppm(const gchar *filename, struct MaxRaster *raster, GError **error) {
+    GMappedFile *mapped_file;
+    const gchar *data;
+    gsize size;
+    gsize position = 2;
+    gint fields[3];
+    gboolean result = TRUE;
+
+    mapped_file = g_mapped_file_new(filename, FALSE, error);
+    if (!mapped_file) {
+        return FALSE;
+    }
+
+    data = g_mapped_file_get_contents(mapped_file);
+    size = g_mapped_file_get_length(mapped_file);
+
+    if (size < 2 || data[0] != 'P' || data[1] != '6') {
+        result = FALSE;
+    }
+
+    for (gint i = 0; result && i < 3; ++i) {
+        while (position < size && (g_ascii_isspace(data[position]) || data[position] == '#')) {
+            if (data[position] == '#') {
+                gsize end = position;
+
+                while (end < size && data[end] != '\n') {
+                    ++end;
+                }
+
+                if (end - position > strlen("# " HOTSPOT_KEY) &&
+                    strncmp(&data[position], "# " HOTSPOT_KEY, strlen("# " HOTSPOT_KEY)) == 0) {
+                    gchar *line = g_strndup(&data[position], end - position);
+
+                    sscanf(line, "# " HOTSPOT_KEY " %hd %hd", &raster->hotx, &raster->hoty);
+                    g_free(line);
+                }
+
+                position = end;
+
+            } else {
+                ++position;
+            }
+        }
+
+        fields[i] = 0;
+
+        if (position >= size || !g_ascii_isdigit(data[position])) {
+            result = FALSE;
+        }
+
+        while (result && position < size && g_ascii_isdigit(data[position]) && fields[i] <= G_MAXINT16) {
+            fields[i] = fields[i] * 10 + data[position++] - '0';
+        }
+    }
+
+    /* a single white space separates the header from the samples */
+    ++position;
+
+    if (!result || fields[0] <= 0 || fields[1] <= 0 || fields[0] > G_MAXINT16 || fields[1] > G_MAXINT16 ||
+        fields[2] != 255 || position > size || size - position < (gsize)fields[0] * fields[1] * 3) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Image format error.");
+        g_mapped_file_unref(mapped_file);
+        return FALSE;
+    }
+
+    raster->width = fields[0];
+    raster->height = fields[1];
+    raster->channels = 3;
+    raster->pixels = g_malloc((gsize)raster->width * raster->height * 3);
+    memcpy(raster->pixels, &data[position], (gsize)raster->width * raster->height * 3);
+
+    g_mapped_file_unref(mapped_file);
+
+    return TRUE;
+}
+
+/**
+ * Writes a binary PPM file. Indexed rasters are expanded through their palette, alpha is dropped.
+ */
+gboolean convert_write_ppm(const gchar *filename, const struct MaxRaster *raster, GError **error) {
+    guchar *row;
+    gboolean result = TRUE;
+    FILE *fd;
+
+    fd = convert_open_output(filename, error);
+    if (!fd) {
+        return FALSE;
+    }
+
+    if (fprintf(fd, "P6\n# " HOTSPOT_KEY " %i %i\n%i %i\n255\n", raster->hotx, raster->hoty, raster->width,
+                raster->height) < 0) {
+        result = FALSE;
+    }
+
+    row = g_malloc((gsize)raster->width * 3);
+
+    for (gint y = 0; result && y < raster->height; ++y) {
+        const guchar *pixels = &raster->pixels[(gsize)y * raster->width * raster->channels];
+
+        for (gint x = 0; x < raster->width; ++x) {
+            const guchar *color =
+                raster->channels == 1 ? &raster->palette[3 * pixels[x]] : &pixels[x * raster->channels];
+
+            memcpy(&row[3 * x], color, 3);
+        }
+
+        if (fwrite(row, 3, raster->width, fd) != (gsize)raster->width) {
+            result = FALSE;
+        }
+    }
+
+    g_free(row);
+
+    if (!result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+    }
+
+    return convert_close_output(filename, fd, result, error);
+}
+
+gboolean convert_write_raster(const gchar *filename, gint target, const struct MaxRaster *raster, GError **error) {
+    if (target == CONVERT_TARGET_PPM) {
+        return convert_write_ppm(filename, raster, error);
+    }
+
+    return convert_write_png(filename, raster, error);
+}
+
+/**
+ * Simple and Big images are written as palette images. Frames of Multi and Shadow files are written as RGBA images
+ * named after the first frame with increasing numbers.
+ */
+gboolean convert_from_max(const struct MaxConvertJob *job, GError **error) {
+    GMappedFile *mapped_file;
+    struct MaxImage *image;
+    struct MaxMulti *multi;
+    gboolean result = FALSE;
+
+    mapped_file = g_mapped_file_new(job->input, FALSE, error);
+    if (!mapped_file) {
+        return FALSE;
+    }
+
+    decode_max_data((const guchar *)g_mapped_file_get_contents(mapped_file), g_mapped_file_get_length(mapped_file),
+                    &image, &multi, error);
+
+    g_mapped_file_unref(mapped_file);
+
+    if (image) {
+        struct MaxRaster raster = {0};
+
+        raster.width = image->width;
+        raster.height = image->height;
+        raster.channels = 1;
+        raster.hotx = image->hotx;
+        raster.hoty = image->hoty;
+        raster.pixels = image->pixels;
+        memcpy(raster.palette, image->palette ? image->palette : max_default_palette, PALETTE_SIZE);
+
+        result = convert_write_raster(job->output, job->target, &raster, error);
+
+        max_image_free(image);
+
+    } else if (multi) {
+        result = TRUE;
+
+        for (gint i = 0; result && i < multi->image_count; ++i) {
+            const struct MaxMultiImage *frame = multi->images[i];
+            struct MaxRaster raster = {0};
+            gchar *output;
+
+            raster.width = frame->width;
+            raster.height = frame->height;
+            raster.channels = 4;
+            raster.hotx = frame->hotx;
+            raster.hoty = frame->hoty;
+            raster.pixels = g_malloc0((gsize)frame->width * frame->height * 4);
+
+            for (gsize j = 0; j < (gsize)frame->width * frame->height; ++j) {
+                if (frame->pixels[MULTI_PIXEL_SIZE * j + 1]) {
+                    memcpy(&raster.pixels[4 * j], &max_default_palette[3 * frame->pixels[MULTI_PIXEL_SIZE * j]], 3);
+                    raster.pixels[4 * j + 3] = 0xFF;
+                }
+            }
+
+            /* the first frame was named when the job was created */
+            output = i ? g_strdup_printf("%.*s%03d%s", (gint)(strlen(job->output) - 7), job->output, i,
+                                         job->target == CONVERT_TARGET_PPM ? ".ppm" : ".png")
+                       : g_strdup(job->output);
+
+            result = convert_write_raster(output, job->target, &raster, error);
+
+            g_free(output);
+            g_free(raster.pixels);
+        }
+
+        max_multi_free(multi);
+    }
+
+    return result;
+}
+
+/**
+ * Maps a true color raster to palette indices. The palette is fitted to the raster for Big files if requested,
+ * otherwise the game palette is used.
+ */
+guchar *convert_get_indices(const struct MaxConvertSettings *settings, const struct MaxRaster *raster,
+                            gint file_type, guchar *palette) {
+    struct MaxPaletteMap *map;
+    struct MaxDither *dither;
+    guchar *indices;
+    gboolean fitted = file_type == MAX_FORMAT_BIG && settings->palette_mode != MAX_PALETTE_GAME;
+    gint first_color = fitted && settings->palette_mode == MAX_PALETTE_RESERVED ? MAX_PALETTE_RESERVED_COLORS : 0;
+
+    memcpy(palette, max_default_palette, PALETTE_SIZE);
+
+    if (fitted) {
+        struct MaxHistogram *histogram = max_histogram_new();
+
+        max_histogram_add(histogram, raster->pixels, raster->channels, (gsize)raster->width * raster->height);
+        max_palette_generate(histogram, palette, first_color, PALETTE_COLORS - first_color);
+        max_histogram_free(histogram);
+    }
+
+    indices = g_malloc((gsize)raster->width * raster->height);
+
+    map = max_palette_map_new(palette, first_color, !fitted);
+    dither = max_dither_new(map, settings->dither_mode, raster->width, 0);
+    max_dither_apply(dither, raster->pixels, raster->channels, indices, 0, raster->height);
+    max_dither_free(dither);
+    max_palette_map_free(map);
+
+    return indices;
+}
+
+/**
+ * Encodes a PNG or PPM file. Automatic selection writes rasters with alpha as single frame Multi files, the others
+ * as the smaller of Simple and Big if the raster uses the game palette and as Big otherwise.
+ */
+gboolean convert_to_max(const struct MaxConvertSettings *settings, const struct MaxConvertJob *job,
+                        GError **error) {
+    struct MaxRaster raster = {0};
+    struct MaxImage image = {0};
+    struct MaxWriter writer;
+    guchar palette[PALETTE_SIZE];
+    guchar *indices;
+    gint file_type = settings->file_type;
+    gchar *name = g_ascii_strdown(job->input, -1);
+    gboolean result;
+    FILE *fd;
+
+    if (g_str_has_suffix(name, ".png")) {
+        result = convert_read_png(job->input, &raster, error);
+    } else {
+        result = convert_read_ppm(job->input, &raster, error);
+    }
+
+    g_free(name);
+
+    if (!result) {
+        return FALSE;
+    }
+
+    if (file_type == MAX_FORMAT_AUTO) {
+        if (raster.channels == 4) {
+            file_type = MAX_FORMAT_MULTI;
+        } else if (raster.channels == 1 && memcmp(raster.palette, max_default_palette, raster.num_colors * 3)) {
+            file_type = MAX_FORMAT_BIG;
+        } else if (raster.channels == 3 && settings->palette_mode != MAX_PALETTE_GAME) {
+            file_type = MAX_FORMAT_BIG;
+        }
+    }
+
+    if (raster.channels == 1) {
+        indices = raster.pixels;
+        memcpy(palette, raster.palette, PALETTE_SIZE);
+    } else {
+        indices = convert_get_indices(settings, &raster, file_type, palette);
+    }
+
+    if (file_type == MAX_FORMAT_AUTO) {
+        gsize big_size = 4 * sizeof(gint16) + PALETTE_SIZE + image_rle_estimate(indices, raster.height, raster.width);
+
+        file_type = big_size < (gsize)raster.width * raster.height + 4 * sizeof(gint16) ? MAX_FORMAT_BIG
+                                                                                           : MAX_FORMAT_SIMPLE;
+    }
+
+    image.width = raster.width;
+    image.height = raster.height;
+    image.hotx = raster.hotx;
+    image.hoty = raster.hoty;
+    image.pixels = indices;
+    image.palette = palette;
+
+    fd = convert_open_output(job->output, error);
+    if (!fd) {
+        result = FALSE;
+    } else {
+        max_writer_init(&writer, fd);
+
+        if (file_type == MAX_FORMAT_SIMPLE) {
+            result = encode_max_simple(&writer, &image, error);
+
+        } else if (file_type == MAX_FORMAT_BIG) {
+            result = encode_max_big(&writer, &image, settings->rle_mode, error);
+
+        } else {
+            struct MaxMultiImage frame = {0};
+            struct MaxMultiImage *frames[] = {&frame};
+            struct MaxMulti multi = {1, frames};
+
+            frame.width = raster.width;
+            frame.height = raster.height;
+            frame.hotx = raster.hotx;
+            frame.hoty = raster.hoty;
+            frame.pixels = g_malloc((gsize)MULTI_PIXEL_SIZE * raster.width * raster.height);
+
+            for (gsize i = 0; i < (gsize)raster.width * raster.height; ++i) {
+                frame.pixels[MULTI_PIXEL_SIZE * i] = indices[i];
+                frame.pixels[MULTI_PIXEL_SIZE * i + 1] =
+                    raster.channels == 4 && raster.pixels[4 * i + 3] == 0 ? 0 : 0xFF;
+            }
+
+            if (file_type == MAX_FORMAT_SHADOW) {
+                result = encode_max_shadow(&writer, &multi, error);
+            } else {
+                result = encode_max_multi(&writer, &multi, error);
+            }
+
+            g_free(frame.pixels);
+        }
+
+        if (result && !max_writer_flush(&writer, fd)) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "File write error.");
+            result = FALSE;
+        }
+
+        max_writer_free(&writer);
+        result = convert_close_output(job->output, fd, result, error);
+    }
+
+    if (indices != raster.pixels) {
+        g_free(indices);
+    }
+
+    g_free(raster.pixels);
+
+    return result;
+}
+
+gboolean convert_run_job(const struct MaxConvertSettings *settings, const struct MaxConvertJob *job,
+                         gboolean *skipped, GError **error) {
+    *skipped = (job->format > 0 && job->target == CONVERT_TARGET_MAX) ||
+               (!settings->force && convert_is_current(job->input, job->output));
+
+    if (*skipped) {
+        return TRUE;
+    }
+
+    if (job->target == CONVERT_TARGET_MAX) {
+        return convert_to_max(settings, job, error);
+    }
+
+    return convert_from_max(job, error);
+}
+
+/**
+ * Packs the M.A.X. outputs of the jobs into the archive, named after their file name without extension. The archive
+ * is updated in place unless conversions are forced.
+ */
+gboolean convert_pack(const struct MaxConvertSettings *settings, const GPtrArray *jobs, GError **error) {
+    GPtrArray *mapped_files = g_ptr_array_new_with_free_func((GDestroyNotify)g_mapped_file_unref);
+    GArray *items = g_array_new(FALSE, FALSE, sizeof(struct MaxResourceItem));
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *outputs = g_hash_table_new(g_str_hash, g_str_equal);
+    gboolean result = TRUE;
+
+    for (guint i = 0; result && i < jobs->len; ++i) {
+        const struct MaxConvertJob *job = g_ptr_array_index(jobs, i);
+        struct MaxResourceItem item;
+        GMappedFile *mapped_file;
+        gchar *name;
+
+        /* a M.A.X. file converted in place is found as an input of its own as well */
+        if (job->failed || job->target != CONVERT_TARGET_MAX || !g_hash_table_add(outputs, job->output)) {
+            continue;
+        }
+
+        mapped_file = g_mapped_file_new(job->output, FALSE, error);
+        if (!mapped_file) {
+            result = FALSE;
+            break;
+        }
+
+        name = g_path_get_basename(job->output);
+        name[strcspn(name, ".")] = '\0';
+
+        item.name = name;
+        item.data = (const guchar *)g_mapped_file_get_contents(mapped_file);
+        item.size = g_mapped_file_get_length(mapped_file);
+
+        g_ptr_array_add(mapped_files, mapped_file);
+        g_ptr_array_add(names, name);
+        g_array_append_val(items, item);
+    }
+
+    if (result) {
+        result = max_resource_write(settings->archive, &g_array_index(items, struct MaxResourceItem, 0), items->len,
+                                    !settings->force, error);
+    }
+
+    if (result && settings->verbose) {
+        g_print("%u entries -> %s\n", items->len, settings->archive);
+    }
+
+    g_hash_table_destroy(outputs);
+    g_array_free(items, TRUE);
+    g_ptr_array_free(names, TRUE);
+    g_ptr_array_free(mapped_files, TRUE);
+
+    return result;
+}
+
+/**
+ * Takes the newest job of the own queue or steals the oldest job of another queue. Returns NULL once all queues are
+ * empty, no jobs are added after the workers started.
+ */
+struct MaxConvertJob *convert_next_job(struct MaxWorkPool *pool, gint index) {
+    struct MaxConvertJob *job;
+
+    for (gint i = 0; i < pool->queue_count; ++i) {
+        struct MaxWorkQueue *queue = &pool->queues[(index + i) % pool->queue_count];
+
+        g_mutex_lock(&queue->mutex);
+        job = i == 0 ? g_queue_pop_tail(&queue->jobs) : g_queue_pop_head(&queue->jobs);
+        g_mutex_unlock(&queue->mutex);
+
+        if (job) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+gpointer convert_worker(gpointer data) {
+    struct MaxWorker *worker = data;
+    struct MaxWorkPool *pool = worker->pool;
+    struct MaxConvertJob *job;
+
+    while ((job = convert_next_job(pool, worker->index))) {
+        GError *error = NULL;
+        gboolean skipped = FALSE;
+
+        if (!convert_run_job(pool->settings, job, &skipped, &error)) {
+            g_printerr("max-convert: %s: %s\n", job->input, error ? error->message : "Conversion failed.");
+            g_clear_error(&error);
+            g_atomic_int_inc(&pool->failed);
+            job->failed = TRUE;
+
+        } else if (skipped) {
+            g_atomic_int_inc(&pool->skipped);
+
+        } else {
+            if (pool->settings->verbose) {
+                g_print("%s -> %s\n", job->input, job->output);
+            }
+
+            g_atomic_int_inc(&pool->converted);
+        }
+    }
+
+    return NULL;
+}
+
+void convert_job_free(gpointer data) {
+    struct MaxConvertJob *job = data;
+
+    g_free(job->input);
+    g_free(job->output);
+    g_free(job);
+}
+
+int main(int argc, char *argv[]) {
+    struct MaxConvertSettings settings = {
+        .target = CONVERT_TARGET_AUTO,
+        .file_type = MAX_FORMAT_AUTO,
+        .rle_mode = MAX_RLE_FAST,
+        .palette_mode = MAX_PALETTE_GAME,
+        .dither_mode = MAX_DITHER_NONE,
+    };
+    struct MaxWorkPool pool = {.settings = &settings};
+    struct MaxWorker *workers;
+    GThread **threads;
+    GOptionContext *context;
+    GPtrArray *jobs;
+    GError *error = NULL;
+    gchar *target = NULL;
+    gchar *format = NULL;
+    gchar *compression = NULL;
+    gchar *palette = NULL;
+    gchar *dither = NULL;
+    gchar **inputs = NULL;
+    gint thread_count;
+    gboolean result;
+
+    GOptionEntry entries[] = {
+        {"target", 't', 0, G_OPTION_ARG_STRING, &target,
+         "Output type: auto, max, png or ppm. Images in directories are only converted with max", "TYPE"},
+        {"format", 'f', 0, G_OPTION_ARG_STRING, &format, "M.A.X. format: auto, simple, big, multi or shadow",
+         "FORMAT"},
+        {"compression", 'c', 0, G_OPTION_ARG_STRING, &compression,
+         "Big compression: fast, smallest, fast-rows or smallest-rows", "MODE"},
+        {"palette", 'p', 0, G_OPTION_ARG_STRING, &palette,
+         "Palette of true color Big files: game, optimized or reserved", "MODE"},
+        {"dither", 'd', 0, G_OPTION_ARG_STRING, &dither,
+         "Dithering of true color images: none, ordered or floyd-steinberg", "MODE"},
+        {"output", 'o', 0, G_OPTION_ARG_FILENAME, &settings.output_dir, "Write outputs below DIR", "DIR"},
+        {"archive", 'a', 0, G_OPTION_ARG_FILENAME, &settings.archive, "Pack M.A.X. files into archive FILE", "FILE"},
+        {"recursive", 'r', 0, G_OPTION_ARG_NONE, &settings.recursive, "Descend into subdirectories", NULL},
+        {"force", 'F', 0, G_OPTION_ARG_NONE, &settings.force, "Convert files with up to date outputs", NULL},
+        {"jobs", 'j', 0, G_OPTION_ARG_INT, &settings.jobs, "Number of worker threads", "N"},
+        {"verbose", 'v', 0, G_OPTION_ARG_NONE, &settings.verbose, "List converted files", NULL},
+        {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL, "FILE|DIR..."},
+        {NULL},
+    };
+
+    context = g_option_context_new("- convert M.A.X. graphics files");
+    g_option_context_set_summary(context,
+                                 "Converts M.A.X. files to PNG or PPM images and images to M.A.X. files. Version "
+                                 MAX_CONVERT_VERSION ".");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    result = g_option_context_parse(context, &argc, &argv, &error) &&
+             convert_parse_choice("target", target, target_names, &settings.target, &error) &&
+             convert_parse_choice("format", format, format_names, &settings.file_type, &error) &&
+             convert_parse_choice("compression", compression, compression_names, &settings.rle_mode, &error) &&
+             convert_parse_choice("palette", palette, palette_names, &settings.palette_mode, &error) &&
+             convert_parse_choice("dither", dither, dither_names, &settings.dither_mode, &error);
+
+    g_option_context_free(context);
+
+    if (result && settings.archive && settings.target != CONVERT_TARGET_AUTO && settings.target != CONVERT_TARGET_MAX) {
+        g_set_error(&error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Archives hold M.A.X. files only.");
+        result = FALSE;
+    }
+
+    if (!result || !inputs) {
+        g_printerr("max-convert: %s\n", error ? error->message : "No input files.");
+        g_clear_error(&error);
+        g_strfreev(inputs);
+        g_free(settings.output_dir);
+        g_free(settings.archive);
+        g_free(target);
+        g_free(format);
+        g_free(compression);
+        g_free(palette);
+        g_free(dither);
+        return EXIT_FAILURE;
+    }
+
+    jobs = g_ptr_array_new_with_free_func(convert_job_free);
+
+    for (gint i = 0; inputs[i]; ++i) {
+        if (g_file_test(inputs[i], G_FILE_TEST_IS_DIR)) {
+            convert_scan(&settings, jobs, inputs[i], inputs[i]);
+        } else {
+            convert_add_job(&settings, jobs, inputs[i], NULL, TRUE);
+        }
+    }
+
+    thread_count = settings.jobs > 0 ? settings.jobs : (gint)g_get_num_processors();
+    thread_count = MAX(1, MIN(thread_count, (gint)jobs->len));
+
+    pool.queue_count = thread_count;
+    pool.queues = g_malloc0(thread_count * sizeof(struct MaxWorkQueue));
+
+    for (gint i = 0; i < thread_count; ++i) {
+        g_mutex_init(&pool.queues[i].mutex);
+        g_queue_init(&pool.queues[i].jobs);
+    }
+
+    for (guint i = 0; i < jobs->len; ++i) {
+        g_queue_push_tail(&pool.queues[i % thread_count].jobs, g_ptr_array_index(jobs, i));
+    }
+
+    workers = g_malloc0(thread_count * sizeof(struct MaxWorker));
+    threads = g_malloc0(thread_count * sizeof(GThread *));
+
+    for (gint i = 1; i < thread_count; ++i) {
+        workers[i].pool = &pool;
+        workers[i].index = i;
+        threads[i] = g_thread_new("max-convert", convert_worker, &workers[i]);
+    }
+
+    workers[0].pool = &pool;
+    convert_worker(&workers[0]);
+
+    for (gint i = 1; i < thread_count; ++i) {
+        g_thread_join(threads[i]);
+    }
+
+    if (settings.verbose) {
+        g_print("%i converted, %i up to date, %i failed\n", pool.converted, pool.skipped, pool.failed);
+    }
+
+    if (settings.archive && !convert_pack(&settings, jobs, &error)) {
+        g_printerr("max-convert: %s: %s\n", settings.archive, error->message);
+        g_clear_error(&error);
+        pool.failed++;
+    }
+
+    for (gint i = 0; i < thread_count; ++i) {
+        g_mutex_clear(&pool.queues[i].mutex);
+    }
+
+    g_free(threads);
+    g_free(workers);
+    g_free(pool.queues);
+    g_ptr_array_free(jobs, TRUE);
+    g_strfreev(inputs);
+    g_free(settings.output_dir);
+    g_free(settings.archive);
+    g_free(target);
+    g_free(format);
+    g_free(compression);
+    g_free(palette);
+    g_free(dither);
+
+    return pool.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,626 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "max-palette.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "max-simd.h"
+
+/** Slice of the pixels counted by one thread of the histogram pool. */
+struct MaxHistogramTask {
+    const guchar *pixels;
+    gint bpp;
+    gsize count;
+    guint32 *counts;
+};
+
+/** Occupied histogram cell, the color is stored in cell coordinates. */
+struct MaxHistogramEntry {
+    guchar color[3];
+    guint32 count;
+};
+
+/** Range of histogram entries that becomes one palette color. The box is split along the channel of largest extent. */
+struct MaxColorBox {
+    gint start;
+    gint end;
+    guint64 count;
+    gint channel;
+    gint extent;
+};
+
+/** Shared state of the Floyd-Steinberg workers. Rows are claimed in order and every row publishes how many of its
+ * pixels are final, a row may only diffuse up to one pixel behind the row above it.
+ */
+struct MaxDitherJob {
+    struct MaxDither *dither;
+    const guchar *pixels;
+    gint bpp;
+    guchar *indices;
+    gint y;
+    gint rows;
+    gint next_row;
+    gint *progress;
+};
+
+/** Rows of an ordered dither job, rows are independent of each other. */
+struct MaxDitherTask {
+    struct MaxDither *dither;
+    const guchar *pixels;
+    gint bpp;
+    guchar *indices;
+    gint y;
+    gint rows;
+};
+
+static const guchar max_dither_bayer[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26}, {12, 44, 4, 36, 14, 46, 6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22}, {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37},  {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static gchar *max_palette_map_get_cache_file(const guchar *palette, gint first_color);
+static void max_palette_map_build(struct MaxPaletteMap *map);
+static void max_palette_map_get_digest(const guchar *lut, guint8 *digest);
+static gboolean max_palette_map_load(struct MaxPaletteMap *map, const gchar *filename);
+static void max_palette_map_store(const struct MaxPaletteMap *map, const gchar *filename);
+static void max_histogram_count(const guchar *pixels, gint bpp, gsize count, guint32 *counts);
+static void max_histogram_task(gpointer data, gpointer user_data);
+static gint max_histogram_compare(gconstpointer a, gconstpointer b, gpointer user_data);
+static void max_color_box_update(struct MaxColorBox *box, const struct MaxHistogramEntry *entries);
+static void max_dither_ordered_task(gpointer data, gpointer user_data);
+static void max_dither_diffuse_task(gpointer data, gpointer user_data);
+
+gchar *max_palette_map_get_cache_file(const guchar *palette, gint first_color) {
+    gchar *checksum;
+    gchar *basename;
+    gchar *filename;
+
+    checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, palette, PALETTE_SIZE);
+    basename =
+        g_strdup_printf("palette-v%i-%i-%i-%s.lut", MAX_LUT_CACHE_VERSION, MAX_LUT_BITS, first_color, checksum);
+    filename = g_build_filename(g_get_user_cache_dir(), MAX_LUT_CACHE_DIR, basename, NULL);
+
+    g_free(basename);
+    g_free(checksum);
+
+    return filename;
+}
+
+/**
+ * Every cell is mapped to the palette entry from first_color on that is nearest to its center. The quantized channels
+ * are expanded back to the full range so that black and white cells map to exact black and white.
+ */
+void max_palette_map_build(struct MaxPaletteMap *map) {
+    for (gint i = 0; i < MAX_LUT_SIZE; ++i) {
+        gint r = i >> (2 * MAX_LUT_BITS);
+        gint g = (i >> MAX_LUT_BITS) & ((1 << MAX_LUT_BITS) - 1);
+        gint b = i & ((1 << MAX_LUT_BITS) - 1);
+        gint best_distance = G_MAXINT;
+        gint best_index = map->first_color;
+
+        r = (r << (8 - MAX_LUT_BITS)) | (r >> (2 * MAX_LUT_BITS - 8));
+        g = (g << (8 - MAX_LUT_BITS)) | (g >> (2 * MAX_LUT_BITS - 8));
+        b = (b << (8 - MAX_LUT_BITS)) | (b >> (2 * MAX_LUT_BITS - 8));
+
+        for (gint j = map->first_color; j < PALETTE_COLORS && best_distance; ++j) {
+            gint dr = r - map->palette[3 * j];
+            gint dg = g - map->palette[3 * j + 1];
+            gint db = b - map->palette[3 * j + 2];
+            gint distance = dr * dr + dg * dg + db * db;
+
+            if (distance < best_distance) {
+                best_distance = distance;
+                best_index = j;
+            }
+        }
+
+        map->lut[i] = best_index;
+    }
+}
+
+void max_palette_map_get_digest(const guchar *lut, guint8 *digest) {
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    gsize length = MAX_LUT_CACHE_DIGEST_SIZE;
+
+    g_checksum_update(checksum, lut, MAX_LUT_SIZE);
+    g_checksum_get_digest(checksum, digest, &length);
+    g_checksum_free(checksum);
+}
+
+/**
+ * Loads the table from a cache file. Files of another version or table size and files whose table does not match the
+ * stored digest are rejected.
+ */
+gboolean max_palette_map_load(struct MaxPaletteMap *map, const gchar *filename) {
+    const gsize id_size = sizeof(MAX_LUT_CACHE_ID) - 1;
+    guint8 digest[MAX_LUT_CACHE_DIGEST_SIZE];
+    gchar *contents = NULL;
+    gsize length = 0;
+    gboolean result;
+
+    result = g_file_get_contents(filename, &contents, &length, NULL) &&
+             length == MAX_LUT_CACHE_HEADER_SIZE + MAX_LUT_SIZE && memcmp(contents, MAX_LUT_CACHE_ID, id_size) == 0 &&
+             max_get_int16((const guchar *)&contents[id_size]) == MAX_LUT_CACHE_VERSION &&
+             max_get_int16((const guchar *)&contents[id_size + sizeof(gint16)]) == MAX_LUT_BITS;
+
+    if (result) {
+        const guchar *lut = (const guchar *)&contents[MAX_LUT_CACHE_HEADER_SIZE];
+
+        max_palette_map_get_digest(lut, digest);
+        result = memcmp(digest, &contents[id_size + 2 * sizeof(gint16)], MAX_LUT_CACHE_DIGEST_SIZE) == 0;
+
+        if (result) {
+            memcpy(map->lut, lut, MAX_LUT_SIZE);
+        }
+    }
+
+    g_free(contents);
+
+    return result;
+}
+
+void max_palette_map_store(const struct MaxPaletteMap *map, const gchar *filename) {
+    const gsize id_size = sizeof(MAX_LUT_CACHE_ID) - 1;
+    gchar *dirname = g_path_get_dirname(filename);
+    guchar *contents = g_malloc(MAX_LUT_CACHE_HEADER_SIZE + MAX_LUT_SIZE);
+
+    memcpy(contents, MAX_LUT_CACHE_ID, id_size);
+    max_put_int16(&contents[id_size], MAX_LUT_CACHE_VERSION);
+    max_put_int16(&contents[id_size + sizeof(gint16)], MAX_LUT_BITS);
+    max_palette_map_get_digest(map->lut, &contents[id_size + 2 * sizeof(gint16)]);
+    memcpy(&contents[MAX_LUT_CACHE_HEADER_SIZE], map->lut, MAX_LUT_SIZE);
+
+    if (g_mkdir_with_parents(dirname, 0755) == 0) {
+        g_file_set_contents(filename, (const gchar *)contents, MAX_LUT_CACHE_HEADER_SIZE + MAX_LUT_SIZE, NULL);
+    }
+
+    g_free(contents);
+    g_free(dirname);
+}
+
+/**
+ * Returns the lookup table of the palette. If cached is set, the table is loaded from the user cache directory if it
+ * was built before and stored there otherwise. Failing to read or write the cache only costs the time to build the
+ * table. Palettes fitted to a single image should not be cached. Only the entries from first_color on are used, which
+ * keeps pixels off the entries reserved by MAX_PALETTE_RESERVED.
+ */
+struct MaxPaletteMap *max_palette_map_new(const guchar *palette, gint first_color, gboolean cached) {
+    struct MaxPaletteMap *map;
+    gchar *filename;
+
+    map = g_malloc0(sizeof(struct MaxPaletteMap));
+    memcpy(map->palette, palette, PALETTE_SIZE);
+    map->first_color = CLAMP(first_color, 0, PALETTE_COLORS - 1);
+
+    /* the vectorized lookup reads four bytes per entry */
+    map->lut = g_malloc0(MAX_LUT_SIZE + 3);
+
+    if (!cached) {
+        max_palette_map_build(map);
+        return map;
+    }
+
+    filename = max_palette_map_get_cache_file(palette, map->first_color);
+
+    if (!max_palette_map_load(map, filename)) {
+        max_palette_map_build(map);
+        max_palette_map_store(map, filename);
+    }
+
+    g_free(filename);
+
+    return map;
+}
+
+/**
+ * Maps count pixels of bpp bytes, 3 for RGB or 4 for RGBA, to palette indices. Alpha is ignored. The indices may be
+ * written over the pixels.
+ */
+void max_palette_map_apply(const struct MaxPaletteMap *map, const guchar *pixels, gint bpp, guchar *indices,
+                           gsize count) {
+    max_map_pixels(map->lut, pixels, bpp, indices, count);
+}
+
+void max_palette_map_free(struct MaxPaletteMap *map) {
+    if (map) {
+        g_free(map->lut);
+        g_free(map);
+    }
+}
+
+void max_histogram_count(const guchar *pixels, gint bpp, gsize count, guint32 *counts) {
+    for (gsize i = 0; i < count; ++i, pixels += bpp) {
+        counts[((guint)(pixels[0] >> (8 - MAX_HISTOGRAM_BITS)) << (2 * MAX_HISTOGRAM_BITS)) |
+               ((guint)(pixels[1] >> (8 - MAX_HISTOGRAM_BITS)) << MAX_HISTOGRAM_BITS) |
+               (pixels[2] >> (8 - MAX_HISTOGRAM_BITS))]++;
+    }
+}
+
+void max_histogram_task(gpointer data, gpointer user_data) {
+    struct MaxHistogramTask *task = data;
+
+    max_histogram_count(task->pixels, task->bpp, task->count, task->counts);
+}
+
+gint max_histogram_compare(gconstpointer a, gconstpointer b, gpointer user_data) {
+    gint channel = GPOINTER_TO_INT(user_data);
+
+    return (gint)((const struct MaxHistogramEntry *)a)->color[channel] -
+           (gint)((const struct MaxHistogramEntry *)b)->color[channel];
+}
+
+void max_color_box_update(struct MaxColorBox *box, const struct MaxHistogramEntry *entries) {
+    guchar minimum[3] = {G_MAXUINT8, G_MAXUINT8, G_MAXUINT8};
+    guchar maximum[3] = {0, 0, 0};
+
+    box->count = 0;
+
+    for (gint i = box->start; i < box->end; ++i) {
+        box->count += entries[i].count;
+
+        for (gint j = 0; j < 3; ++j) {
+            minimum[j] = MIN(minimum[j], entries[i].color[j]);
+            maximum[j] = MAX(maximum[j], entries[i].color[j]);
+        }
+    }
+
+    box->channel = 0;
+    box->extent = 0;
+
+    for (gint j = 0; j < 3; ++j) {
+        if (maximum[j] - minimum[j] > box->extent) {
+            box->channel = j;
+            box->extent = maximum[j] - minimum[j];
+        }
+    }
+}
+
+void max_dither_ordered_task(gpointer data, gpointer user_data) {
+    struct MaxDitherTask *task = data;
+    gint width = task->dither->width;
+    guchar *row = g_malloc((gsize)width * 3);
+
+    for (gint i = 0; i < task->rows; ++i) {
+        const guchar *pixels = &task->pixels[(gsize)i * width * task->bpp];
+        const guchar *threshold = max_dither_bayer[(task->y + i) & 7];
+
+        for (gint x = 0; x < width; ++x) {
+            gint offset = ((2 * threshold[x & 7] + 1 - 64) * MAX_DITHER_ORDERED_SPREAD) / 128;
+
+            for (gint j = 0; j < 3; ++j) {
+                row[3 * x + j] = CLAMP(pixels[x * task->bpp + j] + offset, 0, G_MAXUINT8);
+            }
+        }
+
+        max_palette_map_apply(task->dither->map, row, 3, &task->indices[(gsize)i * width], width);
+    }
+
+    g_free(row);
+}
+
+/**
+ * Floyd-Steinberg worker. Workers claim the next row and diffuse it in spans of MAX_DITHER_SPAN pixels as soon as the
+ * row above is far enough ahead. A row only depends on rows claimed before it, so any number of workers finishes and
+ * every pixel is computed the same way.
+ */
+void max_dither_diffuse_task(gpointer data, gpointer user_data) {
+    struct MaxDitherJob *job = data;
+    struct MaxDither *dither = job->dither;
+    gint width = dither->width;
+    gint row;
+
+    while ((row = g_atomic_int_add(&job->next_row, 1)) < job->rows) {
+        gint y = job->y + row;
+        gint32 *current = &dither->errors[y & 1][4];
+        gint32 *next = &dither->errors[(y + 1) & 1][4];
+        gint32 carry[4] = {0, 0, 0, 0};
+
+        for (gint x = 0; x < width;) {
+            gint end = MIN(x + MAX_DITHER_SPAN, width);
+            gint above;
+
+            /* the row above must have diffused one pixel past the span, the first row of a job is never waited on */
+            while (row > 0 && (above = g_atomic_int_get(&job->progress[row - 1])) < width && above < end + 1) {
+                g_thread_yield();
+            }
+
+            if (x == 0) {
+                memset(&next[-4], 0, 2 * 4 * sizeof(gint32));
+            }
+
+            max_dither_span(dither->map->lut, dither->map->palette, &job->pixels[(gsize)row * width * job->bpp],
+                            job->bpp, &job->indices[(gsize)row * width], current, next, carry, x, end);
+
+            x = end;
+            g_atomic_int_set(&job->progress[row], x);
+        }
+    }
+}
+
+/**
+ * Creates the dithering state of an image of the given width. The rows passed to max_dither_apply are mapped by up to
+ * the given number of threads, or by one thread per processor if it is not positive.
+ */
+struct MaxDither *max_dither_new(const struct MaxPaletteMap *map, gint mode, gint width, gint threads) {
+    struct MaxDither *dither;
+
+    dither = g_malloc0(sizeof(struct MaxDither));
+    dither->map = map;
+    dither->mode = mode;
+    dither->width = width;
+    dither->threads = threads > 0 ? threads : (gint)g_get_num_processors();
+
+    if (mode == MAX_DITHER_FLOYD_STEINBERG) {
+        /* one pixel of padding on both sides of the error rows */
+        for (gint i = 0; i < 2; ++i) {
+            dither->errors[i] = g_malloc0((gsize)(width + 2) * 4 * sizeof(gint32));
+        }
+    }
+
+    return dither;
+}
+
+/**
+ * Maps rows of RGB or RGBA pixels starting at row y of the image to palette indices. Floyd-Steinberg continues from
+ * the previously mapped rows, so the rows of an image must be passed in order. A row may be mapped again, for example
+ * as the look ahead row of a band, as long as no later row was mapped in between. The indices must not overlap the
+ * pixels unless the mode is MAX_DITHER_NONE.
+ */
+void max_dither_apply(struct MaxDither *dither, const guchar *pixels, gint bpp, guchar *indices, gint y, gint rows) {
+    GThreadPool *pool;
+    gint threads = MIN(dither->threads, rows);
+
+    if (dither->mode == MAX_DITHER_NONE || rows <= 0) {
+        max_palette_map_apply(dither->map, pixels, bpp, indices, (gsize)rows * dither->width);
+
+    } else if (dither->mode == MAX_DITHER_ORDERED) {
+        struct MaxDitherTask *tasks = g_malloc0(threads * sizeof(struct MaxDitherTask));
+
+        pool = g_thread_pool_new(max_dither_ordered_task, NULL, threads, FALSE, NULL);
+
+        for (gint i = 0; i < threads; ++i) {
+            gint first = rows * i / threads;
+
+            tasks[i].dither = dither;
+            tasks[i].pixels = &pixels[(gsize)first * dither->width * bpp];
+            tasks[i].bpp = bpp;
+            tasks[i].indices = &indices[(gsize)first * dither->width];
+            tasks[i].y = y + first;
+            tasks[i].rows = rows * (i + 1) / threads - first;
+
+            if (!pool || !g_thread_pool_push(pool, &tasks[i], NULL)) {
+                max_dither_ordered_task(&tasks[i], NULL);
+            }
+        }
+
+        if (pool) {
+            g_thread_pool_free(pool, FALSE, TRUE);
+        }
+
+        g_free(tasks);
+
+    } else {
+        struct MaxDitherJob job = {dither, pixels, bpp, indices, y, rows, 0, NULL};
+
+        job.progress = g_malloc0(rows * sizeof(gint));
+
+        if (y == 0) {
+            memset(dither->errors[0], 0, (gsize)(dither->width + 2) * 4 * sizeof(gint32));
+        }
+
+        pool = g_thread_pool_new(max_dither_diffuse_task, NULL, threads, FALSE, NULL);
+
+        for (gint i = 0; i < threads; ++i) {
+            if (!pool || !g_thread_pool_push(pool, &job, NULL)) {
+                max_dither_diffuse_task(&job, NULL);
+            }
+        }
+
+        if (pool) {
+            g_thread_pool_free(pool, FALSE, TRUE);
+        }
+
+        g_free(job.progress);
+    }
+}
+
+void max_dither_free(struct MaxDither *dither) {
+    if (dither) {
+        g_free(dither->errors[0]);
+        g_free(dither->errors[1]);
+        g_free(dither);
+    }
+}
+
+struct MaxHistogram *max_histogram_new(void) { return g_malloc0(sizeof(struct MaxHistogram)); }
+
+/**
+ * Counts RGB or RGBA pixels into the histogram. Large buffers are split into slices of at least
+ * MAX_HISTOGRAM_SLICE_SIZE pixels that are counted on a thread pool into private histograms and merged afterwards.
+ */
+void max_histogram_add(struct MaxHistogram *histogram, const guchar *pixels, gint bpp, gsize count) {
+    struct MaxHistogramTask *tasks;
+    GThreadPool *pool;
+    gint slices = MIN((gsize)g_get_num_processors(), count / MAX_HISTOGRAM_SLICE_SIZE);
+
+    if (slices <= 1) {
+        max_histogram_count(pixels, bpp, count, histogram->counts);
+        return;
+    }
+
+    tasks = g_malloc0(slices * sizeof(struct MaxHistogramTask));
+
+    pool = g_thread_pool_new(max_histogram_task, NULL, slices, FALSE, NULL);
+
+    for (gint i = 0; i < slices; ++i) {
+        gsize start = count * i / slices;
+
+        tasks[i].pixels = &pixels[start * bpp];
+        tasks[i].bpp = bpp;
+        tasks[i].count = count * (i + 1) / slices - start;
+        tasks[i].counts = g_malloc0(sizeof(histogram->counts));
+
+        if (!pool || !g_thread_pool_push(pool, &tasks[i], NULL)) {
+            max_histogram_task(&tasks[i], NULL);
+        }
+    }
+
+    if (pool) {
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+
+    for (gint i = 0; i < slices; ++i) {
+        for (gint j = 0; j < MAX_HISTOGRAM_SIZE; ++j) {
+            histogram->counts[j] += tasks[i].counts[j];
+        }
+
+        g_free(tasks[i].counts);
+    }
+
+    g_free(tasks);
+}
+
+/**
+ * Median cut quantizer. Fills num_colors palette entries starting at first_color and leaves the other entries alone.
+ * The box with the largest product of pixel count and extent is split at the median of its widest channel until there
+ * are enough boxes, every box becomes the pixel weighted mean of its cells. Returns the number of generated colors,
+ * which is less than num_colors if the image has fewer distinct cells.
+ */
+gint max_palette_generate(const struct MaxHistogram *histogram, guchar *palette, gint first_color, gint num_colors) {
+    struct MaxHistogramEntry *entries;
+    struct MaxColorBox *boxes;
+    gint entry_count = 0;
+    gint box_count = 0;
+
+    num_colors = CLAMP(num_colors, 0, PALETTE_COLORS - first_color);
+
+    if (num_colors <= 0) {
+        return 0;
+    }
+
+    for (gint i = 0; i < MAX_HISTOGRAM_SIZE; ++i) {
+        if (histogram->counts[i]) {
+            ++entry_count;
+        }
+    }
+
+    if (entry_count == 0) {
+        return 0;
+    }
+
+    entries = g_malloc(entry_count * sizeof(struct MaxHistogramEntry));
+
+    for (gint i = 0, j = 0; i < MAX_HISTOGRAM_SIZE; ++i) {
+        if (histogram->counts[i]) {
+            entries[j].color[0] = i >> (2 * MAX_HISTOGRAM_BITS);
+            entries[j].color[1] = (i >> MAX_HISTOGRAM_BITS) & ((1 << MAX_HISTOGRAM_BITS) - 1);
+            entries[j].color[2] = i & ((1 << MAX_HISTOGRAM_BITS) - 1);
+            entries[j].count = histogram->counts[i];
+            ++j;
+        }
+    }
+
+    boxes = g_malloc(num_colors * sizeof(struct MaxColorBox));
+    boxes[0].start = 0;
+    boxes[0].end = entry_count;
+    max_color_box_update(&boxes[0], entries);
+    box_count = 1;
+
+    while (box_count < num_colors) {
+        struct MaxColorBox *box = NULL;
+        guint64 half;
+        guint64 sum = 0;
+        gint split;
+
+        for (gint i = 0; i < box_count; ++i) {
+            if (boxes[i].extent > 0 && (!box || boxes[i].count * boxes[i].extent > box->count * box->extent)) {
+                box = &boxes[i];
+            }
+        }
+
+        if (!box) {
+            break;
+        }
+
+        g_qsort_with_data(&entries[box->start], box->end - box->start, sizeof(struct MaxHistogramEntry),
+                          max_histogram_compare, GINT_TO_POINTER(box->channel));
+
+        half = box->count / 2;
+
+        for (split = box->start; split < box->end - 1; ++split) {
+            sum += entries[split].count;
+
+            if (sum >= half) {
+                break;
+            }
+        }
+
+        /* cells of equal value stay together, the extent guarantees a boundary on either side of the median */
+        ++split;
+
+        while (split < box->end && entries[split].color[box->channel] == entries[split - 1].color[box->channel]) {
+            ++split;
+        }
+
+        if (split == box->end) {
+            split = box->end - 1;
+
+            while (entries[split].color[box->channel] == entries[split - 1].color[box->channel]) {
+                --split;
+            }
+        }
+
+        boxes[box_count].start = split;
+        boxes[box_count].end = box->end;
+        box->end = split;
+
+        max_color_box_update(box, entries);
+        max_color_box_update(&boxes[box_count], entries);
+        ++box_count;
+    }
+
+    for (gint i = 0; i < box_count; ++i) {
+        guint64 sums[3] = {0, 0, 0};
+
+        for (gint j = boxes[i].start; j < boxes[i].end; ++j) {
+            for (gint k = 0; k < 3; ++k) {
+                gint value = entries[j].color[k];
+
+                value = (value << (8 - MAX_HISTOGRAM_BITS)) | (value >> (2 * MAX_HISTOGRAM_BITS - 8));
+                sums[k] += (guint64)value * entries[j].count;
+            }
+        }
+
+        for (gint k = 0; k < 3; ++k) {
+            palette[3 * (first_color + i) + k] = (sums[k] + boxes[i].count / 2) / boxes[i].count;
+        }
+    }
+
+    g_free(boxes);
+    g_free(entries);
+
+    return box_count;
+}
+
+void max_histogram_free(struct MaxHistogram *histogram) { g_free(histogram); }
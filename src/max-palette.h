@@ -0,0 +1,100 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MAX_PALETTE_H
+#define MAX_PALETTE_H
+
+#include <glib.h>
+
+#include "max-codec.h"
+
+#define MAX_LUT_SIZE (1 << (3 * MAX_LUT_BITS))
+#define MAX_LUT_CACHE_DIR "max-codec"
+#define MAX_LUT_CACHE_ID "MLUT"
+#define MAX_LUT_CACHE_VERSION 2
+#define MAX_LUT_CACHE_DIGEST_SIZE 20
+#define MAX_LUT_CACHE_HEADER_SIZE (sizeof(MAX_LUT_CACHE_ID) - 1 + 2 * sizeof(gint16) + MAX_LUT_CACHE_DIGEST_SIZE)
+#define MAX_HISTOGRAM_BITS 5
+#define MAX_HISTOGRAM_SIZE (1 << (3 * MAX_HISTOGRAM_BITS))
+#define MAX_HISTOGRAM_SLICE_SIZE (256 * 1024)
+#define MAX_PALETTE_RESERVED_COLORS 32
+#define MAX_DITHER_SPAN 64
+#define MAX_DITHER_ORDERED_SPREAD 32
+
+/** Palette of true color Big exports. The reserved mode keeps the first MAX_PALETTE_RESERVED_COLORS entries of the
+ * game palette, which hold the transparency key, the shadow and the color cycling entries, and fits the rest.
+ */
+enum MaxPaletteModes {
+    MAX_PALETTE_GAME,
+    MAX_PALETTE_OPTIMIZED,
+    MAX_PALETTE_RESERVED,
+};
+
+enum MaxDitherModes {
+    MAX_DITHER_NONE,
+    MAX_DITHER_ORDERED,
+    MAX_DITHER_FLOYD_STEINBERG,
+};
+
+/** Nearest color lookup table of a palette. The table is indexed by RGB quantized to MAX_LUT_BITS per channel and is
+ * cached on disk by the checksum of the palette as building it takes tens of millions of distance evaluations. Cache
+ * files start with MAX_LUT_CACHE_ID, the cache version, MAX_LUT_BITS and the SHA-1 digest of the table. Bump
+ * MAX_LUT_CACHE_VERSION whenever the table would be built differently. Entries before first_color are never picked,
+ * so that pixels do not land on the reserved entries of a fitted palette.
+ */
+struct MaxPaletteMap {
+    guchar palette[PALETTE_SIZE];
+    gint first_color;
+    guchar *lut;
+};
+
+/** Color histogram of RGB quantized to MAX_HISTOGRAM_BITS per channel. */
+struct MaxHistogram {
+    guint32 counts[MAX_HISTOGRAM_SIZE];
+};
+
+/** Dithering state of an image that is mapped to a palette in bands of rows. Floyd-Steinberg keeps the error of the
+ * row following the last mapped row in one of two error rows selected by the row parity, so the result does not depend
+ * on how the image is split into bands nor on the number of threads.
+ */
+struct MaxDither {
+    const struct MaxPaletteMap *map;
+    gint mode;
+    gint width;
+    gint threads;
+    gint32 *errors[2];
+};
+
+struct MaxPaletteMap *max_palette_map_new(const guchar *palette, gint first_color, gboolean cached);
+void max_palette_map_apply(const struct MaxPaletteMap *map, const guchar *pixels, gint bpp, guchar *indices,
+                           gsize count);
+void max_palette_map_free(struct MaxPaletteMap *map);
+
+struct MaxDither *max_dither_new(const struct MaxPaletteMap *map, gint mode, gint width, gint threads);
+void max_dither_apply(struct MaxDither *dither, const guchar *pixels, gint bpp, guchar *indices, gint y, gint rows);
+void max_dither_free(struct MaxDither *dither);
+
+struct MaxHistogram *max_histogram_new(void);
+void max_histogram_add(struct MaxHistogram *histogram, const guchar *pixels, gint bpp, gsize count);
+gint max_palette_generate(const struct MaxHistogram *histogram, guchar *palette, gint first_color, gint num_colors);
+void max_histogram_free(struct MaxHistogram *histogram);
+
+#endif /* MAX_PALETTE_H */
@@ -0,0 +1,559 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "max-resource.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/** Entry of an archive being written together with its content. */
+struct MaxResourceSlot {
+    struct MaxResourceEntry entry;
+    const guchar *data;
+    gboolean placed;
+};
+
+/** Content stored at one offset of an archive being written. Entries with byte identical content share a block. */
+struct MaxResourceBlock {
+    const guchar *data;
+    gsize size;
+    guint32 offset;
+};
+
+static gboolean max_resource_normalize_name(const gchar *name, gchar *normalized);
+static gint max_resource_compare(gconstpointer a, gconstpointer b, gpointer user_data);
+static gsize max_resource_place(struct MaxResourceSlot *slots, gint count, const struct MaxResource *resource,
+                                GArray *blocks);
+static gsize max_resource_get_live_size(const struct MaxResourceSlot *slots, gint count);
+static gboolean max_resource_write_header(FILE *fd, gsize directory_offset, gint count);
+static gboolean max_resource_write_data(FILE *fd, const GArray *blocks, const struct MaxResourceSlot *slots,
+                                        gint count);
+static gboolean max_resource_sync(FILE *fd);
+
+/**
+ * Converts a name to the upper case form used by the index. Names that do not fit a directory entry are rejected.
+ */
+gboolean max_resource_normalize_name(const gchar *name, gchar *normalized) {
+    gsize length = name ? strlen(name) : 0;
+
+    if (length == 0 || length > MAX_RESOURCE_NAME_SIZE) {
+        return FALSE;
+    }
+
+    for (gsize i = 0; i <= length; ++i) {
+        normalized[i] = g_ascii_toupper(name[i]);
+    }
+
+    return TRUE;
+}
+
+gint max_resource_compare(gconstpointer a, gconstpointer b, gpointer user_data) {
+    return strcmp(((const struct MaxResourceEntry *)a)->name, ((const struct MaxResourceEntry *)b)->name);
+}
+
+/**
+ * Maps a resource archive and builds the index of its directory. Entries must lie within the file. If a name is
+ * listed more than once the first entry of the directory is kept.
+ */
+struct MaxResource *max_resource_open(const gchar *filename, GError **error) {
+    struct MaxResource *resource;
+    struct MaxReader reader;
+    gint32 directory_offset;
+    gint32 directory_size;
+    gint count = 0;
+
+    resource = g_malloc0(sizeof(struct MaxResource));
+
+    resource->mapped_file = g_mapped_file_new(filename, FALSE, error);
+    if (!resource->mapped_file) {
+        g_free(resource);
+        return NULL;
+    }
+
+    resource->data = (const guchar *)g_mapped_file_get_contents(resource->mapped_file);
+    resource->size = g_mapped_file_get_length(resource->mapped_file);
+
+    max_reader_init(&reader, resource->data, resource->size);
+
+    if (resource->size < MAX_RESOURCE_HEADER_SIZE || memcmp(resource->data, MAX_RESOURCE_ID, 4) != 0) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Resource archive format not recognized.");
+        max_resource_close(resource);
+        return NULL;
+    }
+
+    directory_offset = max_get_int32(&resource->data[4]);
+    directory_size = max_get_int32(&resource->data[8]);
+
+    if (directory_offset < 0 || directory_size < 0 || directory_size % MAX_RESOURCE_ENTRY_SIZE ||
+        (gsize)directory_offset + directory_size > resource->size || !max_reader_seek(&reader, directory_offset)) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Resource directory error (offset: %i, size: %i).",
+                    directory_offset, directory_size);
+        max_resource_close(resource);
+        return NULL;
+    }
+
+    resource->entry_count = directory_size / MAX_RESOURCE_ENTRY_SIZE;
+    resource->entries = g_malloc0(MAX(1, resource->entry_count) * sizeof(struct MaxResourceEntry));
+
+    for (gint i = 0; i < resource->entry_count; ++i) {
+        struct MaxResourceEntry *entry = &resource->entries[i];
+        guchar record[MAX_RESOURCE_ENTRY_SIZE];
+        gchar name[MAX_RESOURCE_NAME_SIZE + 1];
+
+        max_reader_read(&reader, record, sizeof(record));
+        memcpy(name, record, MAX_RESOURCE_NAME_SIZE);
+        name[MAX_RESOURCE_NAME_SIZE] = '\0';
+
+        entry->offset = (guint32)max_get_int32(&record[MAX_RESOURCE_NAME_SIZE]);
+        entry->size = (guint32)max_get_int32(&record[MAX_RESOURCE_NAME_SIZE + sizeof(gint32)]);
+
+        if (!max_resource_normalize_name(name, entry->name) || entry->offset > resource->size ||
+            entry->size > resource->size - entry->offset) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Resource directory error (entry: %i).", i);
+            max_resource_close(resource);
+            return NULL;
+        }
+    }
+
+    /* the sort is stable, so the first of several entries of the same name stays in front */
+    g_qsort_with_data(resource->entries, resource->entry_count, sizeof(struct MaxResourceEntry), max_resource_compare,
+                      NULL);
+
+    for (gint i = 0; i < resource->entry_count; ++i) {
+        if (count == 0 || strcmp(resource->entries[count - 1].name, resource->entries[i].name) != 0) {
+            resource->entries[count++] = resource->entries[i];
+        }
+    }
+
+    resource->entry_count = count;
+
+    return resource;
+}
+
+/**
+ * Looks up an entry by name, the name is not case sensitive. Returns NULL if the archive has no such entry.
+ */
+const struct MaxResourceEntry *max_resource_find(const struct MaxResource *resource, const gchar *name) {
+    struct MaxResourceEntry key;
+    gint low = 0;
+    gint high = resource->entry_count;
+
+    if (!max_resource_normalize_name(name, key.name)) {
+        return NULL;
+    }
+
+    while (low < high) {
+        gint middle = low + (high - low) / 2;
+        gint order = strcmp(resource->entries[middle].name, key.name);
+
+        if (order == 0) {
+            return &resource->entries[middle];
+        }
+
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the data of an entry within the mapped archive. The data stays valid until the archive is closed.
+ */
+const guchar *max_resource_get_data(const struct MaxResource *resource, const gchar *name, gsize *size,
+                                    GError **error) {
+    const struct MaxResourceEntry *entry = max_resource_find(resource, name);
+
+    if (!entry) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "Resource '%s' not found.", name);
+        return NULL;
+    }
+
+    *size = entry->size;
+
+    return &resource->data[entry->offset];
+}
+
+/**
+ * Decodes an entry like decode_max_data() does for file data. Returns the format of the entry or -1 on failure.
+ */
+gint max_resource_decode(const struct MaxResource *resource, const gchar *name, struct MaxImage **image,
+                         struct MaxMulti **multi, GError **error) {
+    const guchar *data;
+    gsize size;
+
+    *image = NULL;
+    *multi = NULL;
+
+    data = max_resource_get_data(resource, name, &size, error);
+    if (!data) {
+        return -1;
+    }
+
+    return decode_max_data(data, size, image, multi, error);
+}
+
+/**
+ * Detects the format of an entry like probe_max_file() does for files. Returns -1 if the entry does not exist or is
+ * not a M.A.X. image, the error is only set in the former case.
+ */
+gint max_resource_probe(const struct MaxResource *resource, const gchar *name, struct MaxHeader *header,
+                        GError **error) {
+    const guchar *data;
+    gsize size;
+
+    memset(header, 0, sizeof(struct MaxHeader));
+    header->format = -1;
+
+    data = max_resource_get_data(resource, name, &size, error);
+    if (!data) {
+        return -1;
+    }
+
+    return sniff_max_format(data, size, size, header);
+}
+
+void max_resource_close(struct MaxResource *resource) {
+    if (resource) {
+        if (resource->mapped_file) {
+            g_mapped_file_unref(resource->mapped_file);
+        }
+
+        g_free(resource->entries);
+        g_free(resource);
+    }
+}
+
+/**
+ * Assigns offsets to the slots that are not placed yet. If the archive is given, slots whose content equals the entry
+ * of the same name keep that entry and new blocks go behind the end of the file, otherwise they start behind the
+ * header. Content is matched by its checksum and confirmed byte by byte. Only archive blocks of a size wanted by a
+ * changed slot are hashed, so unchanged archives are compared without hashing. Returns the end of the data.
+ */
+gsize max_resource_place(struct MaxResourceSlot *slots, gint count, const struct MaxResource *resource,
+                         GArray *blocks) {
+    GHashTable *table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    gsize end = MAX_RESOURCE_HEADER_SIZE;
+
+    if (resource) {
+        GHashTable *sizes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        end = resource->size;
+
+        for (gint i = 0; i < count; ++i) {
+            const struct MaxResourceEntry *entry = max_resource_find(resource, slots[i].entry.name);
+
+            if (entry && entry->size == slots[i].entry.size &&
+                memcmp(&resource->data[entry->offset], slots[i].data, entry->size) == 0) {
+                slots[i].entry.offset = entry->offset;
+                slots[i].placed = TRUE;
+
+            } else {
+                g_hash_table_add(sizes, GSIZE_TO_POINTER(slots[i].entry.size));
+            }
+        }
+
+        for (gint i = 0; i < resource->entry_count; ++i) {
+            const struct MaxResourceEntry *entry = &resource->entries[i];
+
+            if (g_hash_table_contains(sizes, GSIZE_TO_POINTER(entry->size))) {
+                struct MaxResourceBlock *block = g_malloc(sizeof(struct MaxResourceBlock));
+
+                block->data = &resource->data[entry->offset];
+                block->size = entry->size;
+                block->offset = entry->offset;
+
+                g_hash_table_replace(table, g_compute_checksum_for_data(G_CHECKSUM_SHA1, block->data, block->size),
+                                     block);
+            }
+        }
+
+        g_hash_table_destroy(sizes);
+    }
+
+    for (gint i = 0; i < count; ++i) {
+        struct MaxResourceSlot *slot = &slots[i];
+        struct MaxResourceBlock *block;
+        gchar *checksum;
+
+        if (slot->placed) {
+            continue;
+        }
+
+        checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, slot->data, slot->entry.size);
+        block = g_hash_table_lookup(table, checksum);
+
+        if (block && block->size == slot->entry.size && memcmp(block->data, slot->data, block->size) == 0) {
+            slot->entry.offset = block->offset;
+            g_free(checksum);
+
+        } else {
+            struct MaxResourceBlock new_block = {slot->data, slot->entry.size, end};
+
+            slot->entry.offset = end;
+            end += slot->entry.size;
+
+            g_array_append_val(blocks, new_block);
+
+            /* a checksum collision keeps the first block in the table */
+            if (block) {
+                g_free(checksum);
+            } else {
+                block = g_malloc(sizeof(struct MaxResourceBlock));
+                *block = new_block;
+                g_hash_table_insert(table, checksum, block);
+            }
+        }
+
+        slot->placed = TRUE;
+    }
+
+    g_hash_table_destroy(table);
+
+    return end;
+}
+
+/**
+ * Size of the header, the directory and the distinct blocks referenced by the slots. The remainder of an updated
+ * archive is content of removed or replaced entries.
+ */
+gsize max_resource_get_live_size(const struct MaxResourceSlot *slots, gint count) {
+    GHashTable *offsets = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gsize size = MAX_RESOURCE_HEADER_SIZE + (gsize)count * MAX_RESOURCE_ENTRY_SIZE;
+
+    for (gint i = 0; i < count; ++i) {
+        if (g_hash_table_add(offsets, GUINT_TO_POINTER(slots[i].entry.offset + 1))) {
+            size += slots[i].entry.size;
+        }
+    }
+
+    g_hash_table_destroy(offsets);
+
+    return size;
+}
+
+gboolean max_resource_write_header(FILE *fd, gsize directory_offset, gint count) {
+    guchar header[MAX_RESOURCE_HEADER_SIZE];
+
+    memcpy(header, MAX_RESOURCE_ID, 4);
+    max_put_int32(&header[4], (gint32)directory_offset);
+    max_put_int32(&header[8], count * MAX_RESOURCE_ENTRY_SIZE);
+
+    return fseek(fd, 0, SEEK_SET) == 0 && fwrite(header, sizeof(header), 1, fd) == 1;
+}
+
+/**
+ * Writes the new blocks and the directory at the current position of the file.
+ */
+gboolean max_resource_write_data(FILE *fd, const GArray *blocks, const struct MaxResourceSlot *slots, gint count) {
+    struct MaxWriter writer;
+    gboolean result = TRUE;
+
+    max_writer_init(&writer, fd);
+
+    for (guint i = 0; result && i < blocks->len; ++i) {
+        const struct MaxResourceBlock *block = &g_array_index(blocks, struct MaxResourceBlock, i);
+
+        result = max_writer_append(&writer, block->data, block->size);
+    }
+
+    for (gint i = 0; result && i < count; ++i) {
+        guchar *record = max_writer_reserve(&writer, MAX_RESOURCE_ENTRY_SIZE);
+
+        if (!record) {
+            result = FALSE;
+            break;
+        }
+
+        /* names are padded with zeros, a name of full length has no terminator */
+        memset(record, 0, MAX_RESOURCE_NAME_SIZE);
+        memcpy(record, slots[i].entry.name, strlen(slots[i].entry.name));
+        max_put_int32(&record[MAX_RESOURCE_NAME_SIZE], (gint32)slots[i].entry.offset);
+        max_put_int32(&record[MAX_RESOURCE_NAME_SIZE + sizeof(gint32)], (gint32)slots[i].entry.size);
+    }
+
+    result = result && max_writer_flush(&writer, fd) && fflush(fd) == 0;
+
+    max_writer_free(&writer);
+
+    return result;
+}
+
+/**
+ * Flushes the stream and waits until the operating system has stored the file on disk.
+ */
+gboolean max_resource_sync(FILE *fd) {
+    if (fflush(fd) != 0) {
+        return FALSE;
+    }
+
+#ifdef G_OS_WIN32
+    return _commit(_fileno(fd)) == 0;
+#else
+    return fsync(fileno(fd)) == 0;
+#endif
+}
+
+/**
+ * Writes the items as a resource archive with a directory sorted by name. Items with byte identical content are stored
+ * once. If update is set and the archive exists, entries whose content did not change keep their data, only new
+ * content and the directory are appended and the header is rewritten last, so an interrupted update leaves the
+ * previous archive intact. An archive that would be more than half unreferenced data is rewritten instead, like
+ * archives written without update. Rewrites go to a temporary file that replaces the archive once complete.
+ */
+gboolean max_resource_write(const gchar *filename, const struct MaxResourceItem *items, gint item_count,
+                            gboolean update, GError **error) {
+    struct MaxResource *resource = NULL;
+    struct MaxResourceSlot *slots;
+    GArray *blocks;
+    gchar *partial;
+    gsize end;
+    gsize old_size = 0;
+    gboolean in_place = FALSE;
+    gboolean result;
+    FILE *fd;
+
+    slots = g_malloc0(MAX(1, item_count) * sizeof(struct MaxResourceSlot));
+
+    for (gint i = 0; i < item_count; ++i) {
+        if (!max_resource_normalize_name(items[i].name, slots[i].entry.name) || items[i].size > G_MAXINT32) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid resource '%s'.", items[i].name);
+            g_free(slots);
+            return FALSE;
+        }
+
+        slots[i].entry.size = items[i].size;
+        slots[i].data = items[i].data;
+    }
+
+    g_qsort_with_data(slots, item_count, sizeof(struct MaxResourceSlot), max_resource_compare, NULL);
+
+    for (gint i = 1; i < item_count; ++i) {
+        if (strcmp(slots[i - 1].entry.name, slots[i].entry.name) == 0) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Duplicate resource '%s'.", slots[i].entry.name);
+            g_free(slots);
+            return FALSE;
+        }
+    }
+
+    if (update && g_file_test(filename, G_FILE_TEST_EXISTS)) {
+        resource = max_resource_open(filename, error);
+        if (!resource) {
+            g_free(slots);
+            return FALSE;
+        }
+    }
+
+    blocks = g_array_new(FALSE, FALSE, sizeof(struct MaxResourceBlock));
+    end = max_resource_place(slots, item_count, resource, blocks);
+
+    if (resource) {
+        gboolean changed = blocks->len > 0 || item_count != resource->entry_count;
+
+        for (gint i = 0; !changed && i < item_count; ++i) {
+            changed = strcmp(slots[i].entry.name, resource->entries[i].name) != 0 ||
+                      slots[i].entry.offset != resource->entries[i].offset;
+        }
+
+        /* new blocks start at the end of the archive, an archive that is mostly dead data is compacted */
+        in_place = changed && 2 * max_resource_get_live_size(slots, item_count) >=
+                                  end + (gsize)item_count * MAX_RESOURCE_ENTRY_SIZE;
+        old_size = resource->size;
+
+        max_resource_close(resource);
+
+        if (!changed) {
+            g_array_free(blocks, TRUE);
+            g_free(slots);
+            return TRUE;
+        }
+
+        if (!in_place) {
+            for (gint i = 0; i < item_count; ++i) {
+                slots[i].placed = FALSE;
+            }
+
+            g_array_set_size(blocks, 0);
+            end = max_resource_place(slots, item_count, NULL, blocks);
+        }
+    }
+
+    if (end + (gsize)item_count * MAX_RESOURCE_ENTRY_SIZE > G_MAXINT32) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Resource archive too large.");
+        g_array_free(blocks, TRUE);
+        g_free(slots);
+        return FALSE;
+    }
+
+    partial = in_place ? g_strdup(filename) : g_strconcat(filename, MAX_RESOURCE_PARTIAL_SUFFIX, NULL);
+
+    fd = g_fopen(partial, in_place ? "r+b" : "wb");
+    if (!fd) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno), "Could not open '%s' for writing: %s",
+                    partial, g_strerror(errno));
+        g_free(partial);
+        g_array_free(blocks, TRUE);
+        g_free(slots);
+        return FALSE;
+    }
+
+    /* data reaches the disk before a header refers to it and before a rewrite replaces the archive */
+    if (in_place) {
+        result = fseek(fd, old_size, SEEK_SET) == 0 && max_resource_write_data(fd, blocks, slots, item_count) &&
+                 max_resource_sync(fd) && max_resource_write_header(fd, end, item_count) && max_resource_sync(fd);
+
+    } else {
+        result = max_resource_write_header(fd, end, item_count) &&
+                 max_resource_write_data(fd, blocks, slots, item_count) && max_resource_sync(fd);
+    }
+
+    if (EOF == fclose(fd)) {
+        result = FALSE;
+    }
+
+    if (result && !in_place && g_rename(partial, filename) != 0) {
+        result = FALSE;
+    }
+
+    if (!result) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO, "Failed to write resource archive '%s'.", filename);
+
+        if (!in_place) {
+            g_unlink(partial);
+        }
+    }
+
+    g_free(partial);
+    g_array_free(blocks, TRUE);
+    g_free(slots);
+
+    return result;
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MAX_RESOURCE_H
+#define MAX_RESOURCE_H
+
+#include <glib.h>
+
+#include "max-codec.h"
+
+#define MAX_RESOURCE_ID "RES0"
+#define MAX_RESOURCE_HEADER_SIZE (4 + 2 * sizeof(gint32))
+#define MAX_RESOURCE_NAME_SIZE 8
+#define MAX_RESOURCE_ENTRY_SIZE (MAX_RESOURCE_NAME_SIZE + 2 * sizeof(gint32))
+#define MAX_RESOURCE_PARTIAL_SUFFIX ".part"
+
+/** Directory entry of a resource archive. Names are upper case and at most MAX_RESOURCE_NAME_SIZE characters long, the
+ * data is located by its absolute file offset.
+ */
+struct MaxResourceEntry {
+    gchar name[MAX_RESOURCE_NAME_SIZE + 1];
+    guint32 offset;
+    guint32 size;
+};
+
+/** Resource archive such as MAX.RES. The file is mapped and its directory is read once into an index sorted by name,
+ * entries are handed out as pointers into the mapping without copying.
+ */
+struct MaxResource {
+    GMappedFile *mapped_file;
+    const guchar *data;
+    gsize size;
+    struct MaxResourceEntry *entries;
+    gint entry_count;
+};
+
+/** Content of an archive entry to be written. The data is referenced, not copied. */
+struct MaxResourceItem {
+    const gchar *name;
+    const guchar *data;
+    gsize size;
+};
+
+struct MaxResource *max_resource_open(const gchar *filename, GError **error);
+const struct MaxResourceEntry *max_resource_find(const struct MaxResource *resource, const gchar *name);
+const guchar *max_resource_get_data(const struct MaxResource *resource, const gchar *name, gsize *size,
+                                    GError **error);
+gint max_resource_decode(const struct MaxResource *resource, const gchar *name, struct MaxImage **image,
+                         struct MaxMulti **multi, GError **error);
+gint max_resource_probe(const struct MaxResource *resource, const gchar *name, struct MaxHeader *header,
+                        GError **error);
+void max_resource_close(struct MaxResource *resource);
+gboolean max_resource_write(const gchar *filename, const struct MaxResourceItem *items, gint item_count,
+                            gboolean update, GError **error);
+
+#endif /* MAX_RESOURCE_H */
@@ -0,0 +1,373 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "max-simd.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAX_SIMD_X86
+#include <immintrin.h>
+#endif
+
+struct MaxSimdKernels {
+    gsize (*find_pattern)(const guchar *buffer, gsize position, gsize limit, gsize size);
+    gsize (*find_mismatch)(const guchar *buffer, gsize position, gsize limit, guchar value);
+    gsize (*find_alpha)(const guchar *pixels, gsize position, gsize limit, gboolean opaque);
+    void (*map_pixels)(const guchar *lut, const guchar *pixels, gint bpp, guchar *indices, gsize count);
+    void (*dither_span)(const guchar *lut, const guchar *palette, const guchar *pixels, gint bpp, guchar *indices,
+                        gint32 *current, gint32 *next, gint32 *carry, gsize start, gsize end);
+};
+
+static inline guint max_lut_index(const guchar *pixel) {
+    return ((guint)(pixel[0] >> (8 - MAX_LUT_BITS)) << (2 * MAX_LUT_BITS)) |
+           ((guint)(pixel[1] >> (8 - MAX_LUT_BITS)) << MAX_LUT_BITS) | (pixel[2] >> (8 - MAX_LUT_BITS));
+}
+
+static inline gboolean max_is_pattern(const guchar *buffer) {
+    return buffer[0] == buffer[1] && buffer[1] == buffer[2] && buffer[2] == buffer[3] && buffer[3] == buffer[4];
+}
+
+static gsize max_find_pattern_c(const guchar *buffer, gsize position, gsize limit, gsize size) {
+    for (; position < limit && position + 4 < size; ++position) {
+        if (max_is_pattern(&buffer[position])) {
+            return position;
+        }
+    }
+
+    return limit;
+}
+
+static gsize max_find_mismatch_c(const guchar *buffer, gsize position, gsize limit, guchar value) {
+    for (; position < limit; ++position) {
+        if (buffer[position] != value) {
+            return position;
+        }
+    }
+
+    return limit;
+}
+
+static gsize max_find_alpha_c(const guchar *pixels, gsize position, gsize limit, gboolean opaque) {
+    for (; position < limit; ++position) {
+        if ((pixels[2 * position + 1] != 0) == opaque) {
+            return position;
+        }
+    }
+
+    return limit;
+}
+
+static void max_map_pixels_c(const guchar *lut, const guchar *pixels, gint bpp, guchar *indices, gsize count) {
+    for (gsize i = 0; i < count; ++i) {
+        indices[i] = lut[max_lut_index(&pixels[i * bpp])];
+    }
+}
+
+static void max_dither_span_c(const guchar *lut, const guchar *palette, const guchar *pixels, gint bpp,
+                              guchar *indices, gint32 *current, gint32 *next, gint32 *carry, gsize start, gsize end) {
+    for (gsize x = start; x < end; ++x) {
+        guchar color[3];
+
+        for (gint i = 0; i < 3; ++i) {
+            gint32 value = pixels[x * bpp + i] + ((current[4 * x + i] + carry[i] + 8) >> 4);
+
+            color[i] = CLAMP(value, 0, G_MAXUINT8);
+        }
+
+        indices[x] = lut[max_lut_index(color)];
+
+        for (gint i = 0; i < 3; ++i) {
+            gint32 error = (gint32)color[i] - palette[3 * indices[x] + i];
+
+            carry[i] = 7 * error;
+            next[4 * x - 4 + i] += 3 * error;
+            next[4 * x + i] += 5 * error;
+            next[4 * x + 4 + i] = error;
+        }
+    }
+}
+
+#ifdef MAX_SIMD_X86
+__attribute__((target("sse2"))) static gsize max_find_pattern_sse2(const guchar *buffer, gsize position, gsize limit,
+                                                                   gsize size) {
+    while (position + 16 <= limit && position + 16 + 4 <= size) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)&buffer[position]);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)&buffer[position + 1]);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)&buffer[position + 2]);
+        __m128i v3 = _mm_loadu_si128((const __m128i *)&buffer[position + 3]);
+        __m128i v4 = _mm_loadu_si128((const __m128i *)&buffer[position + 4]);
+        __m128i equal = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, v1), _mm_cmpeq_epi8(v1, v2)),
+                                      _mm_and_si128(_mm_cmpeq_epi8(v2, v3), _mm_cmpeq_epi8(v3, v4)));
+        guint mask = _mm_movemask_epi8(equal);
+
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+
+        position += 16;
+    }
+
+    return max_find_pattern_c(buffer, position, limit, size);
+}
+
+__attribute__((target("sse2"))) static gsize max_find_mismatch_sse2(const guchar *buffer, gsize position,
+                                                                    gsize limit, guchar value) {
+    __m128i pattern = _mm_set1_epi8(value);
+
+    while (position + 16 <= limit) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)&buffer[position]);
+        guint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v0, pattern)) ^ 0xFFFF;
+
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+
+        position += 16;
+    }
+
+    return max_find_mismatch_c(buffer, position, limit, value);
+}
+
+__attribute__((target("sse2"))) static gsize max_find_alpha_sse2(const guchar *pixels, gsize position, gsize limit,
+                                                                 gboolean opaque) {
+    __m128i zero = _mm_setzero_si128();
+    guint flip = opaque ? 0xAAAA : 0;
+
+    while (position + 8 <= limit) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)&pixels[2 * position]);
+        guint mask = ((guint)_mm_movemask_epi8(_mm_cmpeq_epi8(v0, zero)) & 0xAAAA) ^ flip;
+
+        if (mask) {
+            return position + (__builtin_ctz(mask) >> 1);
+        }
+
+        position += 8;
+    }
+
+    return max_find_alpha_c(pixels, position, limit, opaque);
+}
+
+/* The three channels of a pixel are diffused together in one vector, the clamping is done by the saturating packs. */
+__attribute__((target("sse2"))) static void max_dither_span_sse2(const guchar *lut, const guchar *palette,
+                                                                 const guchar *pixels, gint bpp, guchar *indices,
+                                                                 gint32 *current, gint32 *next, gint32 *carry,
+                                                                 gsize start, gsize end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_setr_epi32(8, 8, 8, 0);
+    __m128i error = _mm_loadu_si128((const __m128i *)carry);
+
+    for (gsize x = start; x < end; ++x) {
+        const guchar *pixel = &pixels[x * bpp];
+        __m128i value = _mm_setr_epi32(pixel[0], pixel[1], pixel[2], 0);
+        __m128i diffused = _mm_add_epi32(_mm_loadu_si128((const __m128i *)&current[4 * x]), error);
+        __m128i color;
+        __m128i target;
+        guint32 packed;
+        guchar channels[4];
+
+        value = _mm_add_epi32(value, _mm_srai_epi32(_mm_add_epi32(diffused, round), 4));
+        value = _mm_packus_epi16(_mm_packs_epi32(value, zero), zero);
+        packed = _mm_cvtsi128_si32(value);
+        memcpy(channels, &packed, sizeof(packed));
+
+        indices[x] = lut[max_lut_index(channels)];
+
+        color = _mm_unpacklo_epi16(_mm_unpacklo_epi8(value, zero), zero);
+        target = _mm_setr_epi32(palette[3 * indices[x]], palette[3 * indices[x] + 1], palette[3 * indices[x] + 2], 0);
+        error = _mm_sub_epi32(color, target);
+
+        _mm_storeu_si128((__m128i *)&next[4 * x - 4],
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i *)&next[4 * x - 4]),
+                                       _mm_add_epi32(_mm_slli_epi32(error, 1), error)));
+        _mm_storeu_si128((__m128i *)&next[4 * x],
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i *)&next[4 * x]),
+                                       _mm_add_epi32(_mm_slli_epi32(error, 2), error)));
+        _mm_storeu_si128((__m128i *)&next[4 * x + 4], error);
+
+        error = _mm_sub_epi32(_mm_slli_epi32(error, 3), error);
+    }
+
+    _mm_storeu_si128((__m128i *)carry, error);
+}
+
+__attribute__((target("avx2"))) static gsize max_find_pattern_avx2(const guchar *buffer, gsize position, gsize limit,
+                                                                   gsize size) {
+    while (position + 32 <= limit && position + 32 + 4 <= size) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&buffer[position]);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)&buffer[position + 1]);
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)&buffer[position + 2]);
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)&buffer[position + 3]);
+        __m256i v4 = _mm256_loadu_si256((const __m256i *)&buffer[position + 4]);
+        __m256i equal = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, v1), _mm256_cmpeq_epi8(v1, v2)),
+                                         _mm256_and_si256(_mm256_cmpeq_epi8(v2, v3), _mm256_cmpeq_epi8(v3, v4)));
+        guint mask = _mm256_movemask_epi8(equal);
+
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+
+        position += 32;
+    }
+
+    return max_find_pattern_sse2(buffer, position, limit, size);
+}
+
+__attribute__((target("avx2"))) static gsize max_find_mismatch_avx2(const guchar *buffer, gsize position,
+                                                                    gsize limit, guchar value) {
+    __m256i pattern = _mm256_set1_epi8(value);
+
+    while (position + 32 <= limit) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&buffer[position]);
+        guint mask = ~(guint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, pattern));
+
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+
+        position += 32;
+    }
+
+    return max_find_mismatch_sse2(buffer, position, limit, value);
+}
+
+__attribute__((target("avx2"))) static gsize max_find_alpha_avx2(const guchar *pixels, gsize position, gsize limit,
+                                                                 gboolean opaque) {
+    __m256i zero = _mm256_setzero_si256();
+    guint flip = opaque ? 0xAAAAAAAA : 0;
+
+    while (position + 16 <= limit) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)&pixels[2 * position]);
+        guint mask = ((guint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)) & 0xAAAAAAAA) ^ flip;
+
+        if (mask) {
+            return position + (__builtin_ctz(mask) >> 1);
+        }
+
+        position += 16;
+    }
+
+    return max_find_alpha_sse2(pixels, position, limit, opaque);
+}
+
+/* Eight pixels per step. The pixels and the table entries are fetched with 32 bit gathers, so RGB input must have one
+ * more pixel after the block and the table must be padded by three bytes.
+ */
+__attribute__((target("avx2"))) static void max_map_pixels_avx2(const guchar *lut, const guchar *pixels, gint bpp,
+                                                                guchar *indices, gsize count) {
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bpp));
+    const __m256i channel = _mm256_set1_epi32((1 << MAX_LUT_BITS) - 1);
+    const __m256i gather = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4, 8, 12,
+                                            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    gsize limit = count > 8 ? count - (bpp == 4 ? 7 : 8) : 0;
+    gsize position = 0;
+
+    for (; position < limit; position += 8) {
+        __m256i v0 = _mm256_i32gather_epi32((const int *)&pixels[position * bpp], offsets, 1);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(v0, 8 - MAX_LUT_BITS), channel);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(v0, 16 - MAX_LUT_BITS), channel);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(v0, 24 - MAX_LUT_BITS), channel);
+        __m256i index = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 2 * MAX_LUT_BITS),
+                                                        _mm256_slli_epi32(g, MAX_LUT_BITS)),
+                                        b);
+        __m256i result = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int *)lut, index, 1), gather);
+        guint32 low = _mm_cvtsi128_si32(_mm256_castsi256_si128(result));
+        guint32 high = _mm_cvtsi128_si32(_mm256_extracti128_si256(result, 1));
+
+        memcpy(&indices[position], &low, sizeof(low));
+        memcpy(&indices[position + 4], &high, sizeof(high));
+    }
+
+    max_map_pixels_c(lut, &pixels[position * bpp], bpp, &indices[position], count - position);
+}
+#endif /* MAX_SIMD_X86 */
+
+static const struct MaxSimdKernels *max_simd_get_kernels(void) {
+    static gsize kernels = 0;
+
+    if (g_once_init_enter(&kernels)) {
+        static struct MaxSimdKernels table = {max_find_pattern_c, max_find_mismatch_c, max_find_alpha_c,
+                                              max_map_pixels_c, max_dither_span_c};
+
+#ifdef MAX_SIMD_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2")) {
+            table.find_pattern = max_find_pattern_avx2;
+            table.find_mismatch = max_find_mismatch_avx2;
+            table.find_alpha = max_find_alpha_avx2;
+            table.map_pixels = max_map_pixels_avx2;
+            table.dither_span = max_dither_span_sse2;
+
+        } else if (__builtin_cpu_supports("sse2")) {
+            table.find_pattern = max_find_pattern_sse2;
+            table.find_mismatch = max_find_mismatch_sse2;
+            table.find_alpha = max_find_alpha_sse2;
+            table.dither_span = max_dither_span_sse2;
+        }
+#endif /* MAX_SIMD_X86 */
+
+        g_once_init_leave(&kernels, (gsize)&table);
+    }
+
+    return (const struct MaxSimdKernels *)kernels;
+}
+
+/**
+ * Returns the first position in [position, limit) where five consecutive bytes are equal. The compared bytes may
+ * extend past the limit but never past the size of the buffer. Returns limit if there is no such position.
+ */
+gsize max_find_pattern(const guchar *buffer, gsize position, gsize limit, gsize size) {
+    return max_simd_get_kernels()->find_pattern(buffer, position, limit, size);
+}
+
+/**
+ * Returns the first position in [position, limit) where the buffer differs from value or limit if there is none.
+ */
+gsize max_find_mismatch(const guchar *buffer, gsize position, gsize limit, guchar value) {
+    return max_simd_get_kernels()->find_mismatch(buffer, position, limit, value);
+}
+
+/**
+ * Scans index and alpha pairs. Returns the first pixel in [position, limit) that is opaque or transparent as requested
+ * or limit if there is none.
+ */
+gsize max_find_alpha(const guchar *pixels, gsize position, gsize limit, gboolean opaque) {
+    return max_simd_get_kernels()->find_alpha(pixels, position, limit, opaque);
+}
+
+/**
+ * Maps RGB or RGBA pixels to palette indices through a nearest color table of MAX_LUT_BITS per channel. The indices may
+ * overwrite the pixels in place.
+ */
+void max_map_pixels(const guchar *lut, const guchar *pixels, gint bpp, guchar *indices, gsize count) {
+    max_simd_get_kernels()->map_pixels(lut, pixels, bpp, indices, count);
+}
+
+/**
+ * Floyd-Steinberg diffusion of the pixels in [start, end) of a row. The error rows hold four values per pixel, the
+ * current row is read and the next row, which must have one pixel in front of the row, is accumulated into. The carry
+ * holds the error passed to the right and is updated for the following span. Every kernel computes identical results.
+ */
+void max_dither_span(const guchar *lut, const guchar *palette, const guchar *pixels, gint bpp, guchar *indices,
+                     gint32 *current, gint32 *next, gint32 *carry, gsize start, gsize end) {
+    max_simd_get_kernels()->dither_span(lut, palette, pixels, bpp, indices, current, next, carry, start, end);
+}
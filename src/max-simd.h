@@ -0,0 +1,36 @@
+/* Copyright (c) 2022 M.A.X. Port Team
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MAX_SIMD_H
+#define MAX_SIMD_H
+
+#include <glib.h>
+
+#define MAX_LUT_BITS 6
+
+gsize max_find_pattern(const guchar *buffer, gsize position, gsize limit, gsize size);
+gsize max_find_mismatch(const guchar *buffer, gsize position, gsize limit, guchar value);
+gsize max_find_alpha(const guchar *pixels, gsize position, gsize limit, gboolean opaque);
+void max_map_pixels(const guchar *lut, const guchar *pixels, gint bpp, guchar *indices, gsize count);
+void max_dither_span(const guchar *lut, const guchar *palette, const guchar *pixels, gint bpp, guchar *indices,
+                     gint32 *current, gint32 *next, gint32 *carry, gsize start, gsize end);
+
+#endif /* MAX_SIMD_H */